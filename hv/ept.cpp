@@ -3,9 +3,54 @@
 #include "vcpu.h"
 #include "mtrr.h"
 #include "mm.h"
+#include "hv.h"
+#include "logger.h"
 
 namespace hv {
 
+// build the identity-mapped PDs (and their memory types) for every vcpu
+void prepare_ept_pd_template(ept_pd_template& pd_template, mtrr_data const& mtrrs) {
+  // TODO: allocate a PT for the fixed MTRRs region so that we can get
+  // more accurate memory typing in that area (as opposed to just
+  // mapping the whole PDE as UC).
+
+  for (size_t i = 0; i < ept_pd_count; ++i) {
+    for (size_t j = 0; j < 512; ++j) {
+      // identity-map every GPA to the corresponding HPA
+      auto& pde             = pd_template.pds[i][j];
+      pde.flags             = 0;
+      pde.read_access       = 1;
+      pde.write_access      = 1;
+      pde.execute_access    = 1;
+      pde.ignore_pat        = 0;
+      pde.large_page        = 1;
+      pde.accessed          = 0;
+      pde.dirty             = 0;
+      pde.user_mode_execute = 1;
+      pde.suppress_ve       = 1;
+      pde.page_frame_number = (i << 9) + j;
+      pde.memory_type       = calc_mtrr_mem_type(mtrrs,
+        pde.page_frame_number << 21, 0x1000 << 9);
+    }
+  }
+}
+
+// point the PML4 and PDPT of a secondary view to its own copy of the PDs
+static void prepare_secondary_view(vcpu_ept_data& ept, ept_secondary_view& view) {
+  auto& pml4e             = view.pml4[0];
+  pml4e                   = ept.pml4[0];
+  pml4e.page_frame_number = MmGetPhysicalAddress(&view.pdpt).QuadPart >> 12;
+
+  for (size_t i = 0; i < ept_pd_count; ++i) {
+    auto& pdpte             = view.pdpt[i];
+    pdpte                   = ept.pdpt[i];
+    pdpte.page_frame_number = MmGetPhysicalAddress(&view.pds[i]).QuadPart >> 12;
+  }
+
+  for (size_t i = 0; i < ept_view_pt_count; ++i)
+    view.pt_pfns[i] = MmGetPhysicalAddress(&view.pts[i]).QuadPart >> 12;
+}
+
 // identity-map the EPT paging structures
 void prepare_ept(vcpu_ept_data& ept) {
   memset(&ept, 0, sizeof(ept));
@@ -14,6 +59,8 @@ void prepare_ept(vcpu_ept_data& ept) {
 
   ept.num_used_free_pages = 0;
 
+  ept.pml_drained = ept_pml_entry_count;
+
   for (size_t i = 0; i < ept_free_page_count; ++i)
     ept.free_page_pfns[i] = MmGetPhysicalAddress(&ept.free_pages[i]).QuadPart >> 12;
 
@@ -36,12 +83,11 @@ void prepare_ept(vcpu_ept_data& ept) {
   pml4e.user_mode_execute = 1;
   pml4e.page_frame_number = MmGetPhysicalAddress(&ept.pdpt).QuadPart >> 12;
 
-  // MTRR data for setting memory types
-  auto const mtrrs = read_mtrr_data();
-
-  // TODO: allocate a PT for the fixed MTRRs region so that we can get
-  // more accurate memory typing in that area (as opposed to just
-  // mapping the whole PDE as UC).
+  // the PDs are identical for every vcpu since they only point to guest
+  // physical memory, so only the PDPTEs need to point to our own copy
+  static_assert(sizeof(ept.pds_2mb) == sizeof(ghv.ept_template->pds),
+    "EPT PD template size mismatch.");
+  memcpy(ept.pds_2mb, ghv.ept_template->pds, sizeof(ept.pds_2mb));
 
   for (size_t i = 0; i < ept_pd_count; ++i) {
     // point each PDPTE to the corresponding PD
@@ -53,25 +99,31 @@ void prepare_ept(vcpu_ept_data& ept) {
     pdpte.accessed          = 0;
     pdpte.user_mode_execute = 1;
     pdpte.page_frame_number = MmGetPhysicalAddress(&ept.pds[i]).QuadPart >> 12;
-
-    for (size_t j = 0; j < 512; ++j) {
-      // identity-map every GPA to the corresponding HPA
-      auto& pde             = ept.pds_2mb[i][j];
-      pde.flags             = 0;
-      pde.read_access       = 1;
-      pde.write_access      = 1;
-      pde.execute_access    = 1;
-      pde.ignore_pat        = 0;
-      pde.large_page        = 1;
-      pde.accessed          = 0;
-      pde.dirty             = 0;
-      pde.user_mode_execute = 1;
-      pde.suppress_ve       = 0;
-      pde.page_frame_number = (i << 9) + j;
-      pde.memory_type       = calc_mtrr_mem_type(mtrrs,
-        pde.page_frame_number << 21, 0x1000 << 9);
-    }
   }
+
+  // the secondary views use their own PML4 and PDPT so that they can
+  // point to their own copy of the PDs
+  prepare_secondary_view(ept, ept.exec_view);
+  prepare_secondary_view(ept, ept.ve_view);
+
+  update_ept_views(ept);
+
+  // an EPTP for each view
+  auto& eptp                                = ept.eptp_list[ept_view_primary];
+  eptp.flags                                = 0;
+  eptp.memory_type                          = MEMORY_TYPE_WRITE_BACK;
+  eptp.page_walk_length                     = 3;
+  eptp.enable_access_and_dirty_flags        = 0;
+  eptp.enable_supervisor_shadow_stack_pages = 0;
+  eptp.page_frame_number                    = MmGetPhysicalAddress(&ept.pml4).QuadPart >> 12;
+
+  auto& exec_eptp             = ept.eptp_list[ept_view_exec];
+  exec_eptp                   = eptp;
+  exec_eptp.page_frame_number = MmGetPhysicalAddress(&ept.exec_view.pml4).QuadPart >> 12;
+
+  auto& ve_eptp             = ept.eptp_list[ept_view_ve];
+  ve_eptp                   = eptp;
+  ve_eptp.page_frame_number = MmGetPhysicalAddress(&ept.ve_view.pml4).QuadPart >> 12;
 }
 
 // update the memory types in the EPT paging structures based on the MTRRs.
@@ -103,6 +155,8 @@ void update_ept_memory_type(vcpu_ept_data& ept) {
       }
     }
   }
+
+  update_ept_views(ept);
 }
 
 // set the memory type in every EPT paging structure to the specified value
@@ -125,6 +179,124 @@ void set_ept_memory_type(vcpu_ept_data& ept, uint8_t const memory_type) {
       }
     }
   }
+
+  update_ept_views(ept);
+}
+
+// get the PTE for a page in a secondary view, allocating a private PT
+// for it if it is still shared with the primary view
+static ept_pte* get_secondary_view_pte(ept_secondary_view& view,
+    uint64_t const physical_address) {
+  pml4_virtual_address const addr = { reinterpret_cast<void*>(physical_address) };
+
+  if (addr.pml4_idx != 0 || addr.pdpt_idx >= ept_pd_count)
+    return nullptr;
+
+  // the primary PDE needs to be split for the page to have its own PTE
+  if (view.pds_2mb[addr.pdpt_idx][addr.pd_idx].large_page)
+    return nullptr;
+
+  auto& pde = view.pds[addr.pdpt_idx][addr.pd_idx];
+
+  // multiple pages can live in the same private PT
+  for (size_t i = 0; i < view.num_used_pts; ++i) {
+    if (pde.page_frame_number == view.pt_pfns[i])
+      return &view.pts[i][addr.pt_idx];
+  }
+
+  // out of private PTs
+  if (view.num_used_pts >= ept_view_pt_count)
+    return nullptr;
+
+  auto const orig_pt = reinterpret_cast<ept_pte*>(host_physical_memory_base
+    + (pde.page_frame_number << 12));
+
+  auto const pt = view.pts[view.num_used_pts];
+  pde.page_frame_number = view.pt_pfns[view.num_used_pts];
+  ++view.num_used_pts;
+
+  // any access to the other pages in this PT will cause an
+  // ept-violation, which switches back to the primary view. this
+  // means that this PT never needs to be kept in sync.
+  for (size_t i = 0; i < 512; ++i) {
+    pt[i]                = orig_pt[i];
+    pt[i].read_access    = 0;
+    pt[i].write_access   = 0;
+    pt[i].execute_access = 0;
+    pt[i].suppress_ve    = 1;
+  }
+
+  return &pt[addr.pt_idx];
+}
+
+// rebuild the execute and #VE views from the primary EPT paging structures.
+// this returns false if there weren't enough PTs to map every hook and
+// #VE MMR.
+bool update_ept_views(vcpu_ept_data& ept) {
+  // every PT is shared with the primary view by default
+  memcpy(ept.exec_view.pds, ept.pds, sizeof(ept.pds));
+  memcpy(ept.ve_view.pds, ept.pds, sizeof(ept.pds));
+
+  ept.exec_view.num_used_pts = 0;
+  ept.ve_view.num_used_pts   = 0;
+
+  for (auto hook = ept.hooks.active_list_head; hook; hook = hook->next) {
+    auto const pte = get_secondary_view_pte(ept.exec_view,
+      static_cast<uint64_t>(hook->orig_pfn) << 12);
+
+    if (!pte)
+      return false;
+
+    pte->read_access       = 0;
+    pte->write_access      = 0;
+    pte->execute_access    = 1;
+    pte->page_frame_number = hook->exec_pfn;
+  }
+
+  // give the #VE handler its own view where it can access the monitored
+  // pages. they stay monitored in the execute view, since the guest can
+  // keep running in it for a while after executing a hooked page.
+  for (auto const& entry : ept.mmr) {
+    if (entry.size == 0 || entry.backend != mmr_backend_ve)
+      continue;
+
+    for (auto addr = entry.start; addr < entry.start + entry.size; addr += 0x1000) {
+      auto const pte = get_secondary_view_pte(ept.ve_view, addr);
+
+      if (!pte)
+        return false;
+
+      pte->read_access    = 1;
+      pte->write_access   = 1;
+      pte->execute_access = 1;
+      pte->suppress_ve    = 1;
+    }
+  }
+
+  return true;
+}
+
+// get the EPT view that the guest is currently running in
+ept_view current_ept_view(vcpu_ept_data& ept) {
+  ept_pointer eptp;
+  eptp.flags = vmx_vmread(VMCS_CTRL_EPT_POINTER);
+
+  for (size_t i = 0; i < ept_view_count; ++i) {
+    if (eptp.page_frame_number == ept.eptp_list[i].page_frame_number)
+      return static_cast<ept_view>(i);
+  }
+
+  return ept_view_primary;
+}
+
+// switch to a different EPT view. this doesn't require an INVEPT since
+// cached translations are tagged with the EPTP that they came from.
+void set_ept_view(vcpu_ept_data& ept, ept_view const view) {
+  vmx_vmwrite(VMCS_CTRL_EPT_POINTER, ept.eptp_list[view].flags);
+
+  // the #VE handler uses the EPTP index to figure out which view it's in
+  if (ept.ve_info_gpa)
+    vmx_vmwrite(VMCS_CTRL_EPTP_INDEX, view);
 }
 
 // get the corresponding EPT PDPTE for a given physical address
@@ -226,6 +398,11 @@ void split_ept_pde(vcpu_ept_data& ept, ept_pde_2mb* const pde_2mb) {
   pde->execute_access    = 1;
   pde->user_mode_execute = 1;
   pde->page_frame_number = pt_pfn;
+
+  // the secondary views share this PT as well
+  auto const idx = pde_2mb - &ept.pds_2mb[0][0];
+  (&ept.exec_view.pds[0][0])[idx] = *pde;
+  (&ept.ve_view.pds[0][0])[idx]   = *pde;
 }
 
 // memory read/written will use the original page while code
@@ -258,6 +435,12 @@ bool install_ept_hook(vcpu_ept_data& ept,
   // an ept-violation vm-exit where the real "meat" of the ept hook is
   pte->execute_access = 0;
 
+  // the execute view maps this page to the executable page instead
+  if (!update_ept_views(ept)) {
+    remove_ept_hook(ept, original_page_pfn);
+    return false;
+  }
+
   vmx_invept(invept_all_context, {});
 
   return true;
@@ -314,9 +497,37 @@ void remove_ept_hook(vcpu_ept_data& ept, uint64_t const original_page_pfn) {
   pte->execute_access    = 1;
   pte->page_frame_number = original_page_pfn;
 
+  update_ept_views(ept);
+
   vmx_invept(invept_all_context, {});
 }
 
+// set the accessed and dirty flags in every EPT leaf entry so that
+// pages that aren't being tracked don't end up filling the PML
+static void set_ept_ad_flags(vcpu_ept_data& ept) {
+  for (size_t i = 0; i < ept_pd_count; ++i) {
+    for (size_t j = 0; j < 512; ++j) {
+      auto& pde = ept.pds_2mb[i][j];
+
+      // 2MB large page
+      if (pde.large_page) {
+        pde.accessed = 1;
+        pde.dirty    = 1;
+      }
+      // PDE points to a PT
+      else {
+        auto const pt = reinterpret_cast<ept_pte*>(host_physical_memory_base
+          + (ept.pds[i][j].page_frame_number << 12));
+
+        for (size_t k = 0; k < 512; ++k) {
+          pt[k].accessed = 1;
+          pt[k].dirty    = 1;
+        }
+      }
+    }
+  }
+}
+
 // find the EPT hook for the specified PFN
 vcpu_ept_hook_node* find_ept_hook(vcpu_ept_data& ept,
     uint64_t const original_page_pfn) {
@@ -333,5 +544,270 @@ vcpu_ept_hook_node* find_ept_hook(vcpu_ept_data& ept,
   return nullptr;
 }
 
+// enable or disable EPT accessed/dirty flags and PML depending on whether
+// they are currently needed. this function should only be called from
+// root-mode during vmx-operation.
+void update_ept_dirty_tracking(vcpu* const cpu) {
+  auto& ept = cpu->ept;
+
+  // PML-backed MMRs need dirty flags even when dirty logging is disabled
+  auto needed = ept.dirty_logging;
+  for (auto const& entry : ept.mmr) {
+    if (entry.size != 0 && entry.backend == mmr_backend_pml)
+      needed = true;
+  }
+
+  auto const enable_ad = needed &&
+    cpu->cached.ept_vpid_cap.ept_accessed_and_dirty_flags;
+
+  // PML only works when EPT accessed/dirty flags are enabled
+  auto const enable_pml = enable_ad &&
+    cpu->cached.procbased_ctls2_allowed1.enable_pml;
+
+  if (enable_ad != ept.ad_flags_enabled) {
+    if (enable_ad) {
+      set_ept_ad_flags(ept);
+      update_ept_views(ept);
+    }
+
+    for (size_t i = 0; i < ept_view_count; ++i)
+      ept.eptp_list[i].enable_access_and_dirty_flags = enable_ad;
+
+    set_ept_view(ept, current_ept_view(ept));
+
+    ept.ad_flags_enabled = enable_ad;
+  }
+
+  if (enable_pml != ept.pml_enabled) {
+    if (enable_pml)
+      reset_pml(ept);
+    else
+      drain_pml_mmr_entries(ept);
+
+    auto ctrl = read_ctrl_proc_based2();
+    ctrl.enable_pml = enable_pml;
+    write_ctrl_proc_based2(ctrl);
+
+    ept.pml_enabled = enable_pml;
+  }
+
+  vmx_invept(invept_all_context, {});
+}
+
+// find the PML-backed MMR that contains the specified physical page
+vcpu_ept_mmr_entry* find_pml_mmr(vcpu_ept_data& ept,
+    uint64_t const physical_address) {
+  for (auto& entry : ept.mmr) {
+    if (entry.size == 0 || entry.backend != mmr_backend_pml)
+      continue;
+
+    // the PML only records 4KB-aligned GPAs
+    if (physical_address < (entry.start & ~0xFFFull))
+      continue;
+    if (physical_address >= ((entry.start + entry.size + 0xFFF) & ~0xFFFull))
+      continue;
+
+    return &entry;
+  }
+
+  return nullptr;
+}
+
+// stop monitoring an MMR page until the specified TSC value is reached.
+// returns false if too many pages are already suspended.
+bool suspend_mmr_page(vcpu_ept_data& ept,
+    ept_pte* const pte, uint8_t const mode, uint64_t const resume_tsc) {
+  if (ept.num_suspended_mmr_pages >= ept_suspended_mmr_page_count)
+    return false;
+
+  auto& page      = ept.suspended_mmr_pages[ept.num_suspended_mmr_pages++];
+  page.pte        = pte;
+  page.resume_tsc = resume_tsc;
+  page.mode       = mode;
+
+  return true;
+}
+
+// re-enable monitoring on every suspended MMR page whose suspension has
+// expired. returns the TSC value that the next page should be resumed
+// at, or ~0 if there are no more suspended pages.
+uint64_t resume_suspended_mmr_pages(vcpu_ept_data& ept) {
+  if (ept.num_suspended_mmr_pages == 0)
+    return ~0ull;
+
+  auto const tsc = __rdtsc();
+  auto next_resume_tsc = ~0ull;
+  auto resumed = false;
+
+  for (size_t i = 0; i < ept.num_suspended_mmr_pages;) {
+    auto const& page = ept.suspended_mmr_pages[i];
+
+    if (tsc < page.resume_tsc) {
+      next_resume_tsc = min(next_resume_tsc, page.resume_tsc);
+      ++i;
+      continue;
+    }
+
+    auto const pte = page.pte;
+    pte->read_access    = !(page.mode & mmr_memory_mode_r);
+    pte->write_access   = !(page.mode & mmr_memory_mode_w);
+    pte->execute_access = !(page.mode & mmr_memory_mode_x);
+
+    // write access but no read access will generate an EPT misconfiguration
+    if (pte->write_access && !pte->read_access)
+      pte->write_access = 0;
+
+    resumed = true;
+
+    // replace this entry with the last one
+    ept.suspended_mmr_pages[i] =
+      ept.suspended_mmr_pages[--ept.num_suspended_mmr_pages];
+  }
+
+  if (resumed)
+    vmx_invept(invept_all_context, {});
+
+  return next_resume_tsc;
+}
+
+// forget about any suspended MMR pages in the specified physical range
+void cancel_suspended_mmr_pages(vcpu_ept_data& ept,
+    uint64_t const start, uint64_t const size) {
+  for (size_t i = 0; i < ept.num_suspended_mmr_pages;) {
+    auto const pfn = ept.suspended_mmr_pages[i].pte->page_frame_number;
+
+    if ((pfn << 12) < (start & ~0xFFFull) || (pfn << 12) >= start + size) {
+      ++i;
+      continue;
+    }
+
+    // replace this entry with the last one
+    ept.suspended_mmr_pages[i] =
+      ept.suspended_mmr_pages[--ept.num_suspended_mmr_pages];
+  }
+}
+
+// clear the EPT dirty flag for every page in the specified physical range
+void clear_ept_dirty_flags(vcpu_ept_data& ept,
+    uint64_t const start, uint64_t const size) {
+  for (auto addr = start & ~0xFFFull; addr < start + size; addr += 0x1000) {
+    if (auto const pte = get_ept_pte(ept, addr)) {
+      pte->dirty  = 0;
+      pte->flags &= ~ept_pte_soft_dirty;
+      continue;
+    }
+
+    auto const pde_2mb = reinterpret_cast<ept_pde_2mb*>(get_ept_pde(ept, addr));
+
+    // we're past the end of the identity map
+    if (!pde_2mb)
+      return;
+
+    pde_2mb->dirty = 0;
+  }
+}
+
+// check whether the specified physical page was dirtied since the dirty
+// flags were last cleared
+bool is_ept_page_dirty(vcpu_ept_data& ept, uint64_t const physical_address) {
+  if (auto const pte = get_ept_pte(ept, physical_address))
+    return pte->dirty || (pte->flags & ept_pte_soft_dirty);
+
+  auto const pde_2mb = reinterpret_cast<ept_pde_2mb*>(
+    get_ept_pde(ept, physical_address));
+
+  return pde_2mb && pde_2mb->dirty;
+}
+
+// get the GPAs that were logged to the PML since it was last reset. returns
+// the number of valid entries, which start at pml[first].
+size_t get_pml_entries(vcpu_ept_data& ept, size_t& first) {
+  first = ept_pml_entry_count;
+
+  if (!ept.pml_enabled)
+    return 0;
+
+  auto const index = static_cast<uint16_t>(vmx_vmread(VMCS_GUEST_PML_INDEX));
+
+  // the CPU decrements the index after every write, which means that
+  // it will underflow to 0xFFFF once the last entry has been written
+  first = (index >= ept_pml_entry_count) ? 0 : index + 1;
+
+  return ept_pml_entry_count - first;
+}
+
+// log every write to a PML-backed MMR that was added to the PML since the
+// last drain and clear the dirty flag of the written pages, so that the
+// next write gets logged as well
+void drain_pml_mmr_entries(vcpu_ept_data& ept) {
+  size_t first = 0;
+  get_pml_entries(ept, first);
+
+  auto rearmed = false;
+
+  for (auto i = first; i < ept.pml_drained; ++i) {
+    auto const gpa = ept.pml[i];
+
+    if (!find_pml_mmr(ept, gpa))
+      continue;
+
+    HV_LOG_MMR_ACCESS("[PML] wrote to physical page <%p>.", gpa);
+
+    auto const pte = get_ept_pte(ept, gpa);
+    if (!pte)
+      continue;
+
+    // the page still needs to show up as dirty if it is being tracked
+    if (pte->dirty)
+      pte->flags |= ept_pte_soft_dirty;
+
+    pte->dirty = 0;
+    rearmed = true;
+  }
+
+  ept.pml_drained = first;
+
+  if (rearmed)
+    vmx_invept(invept_all_context, {});
+}
+
+// remove every PML entry that lies in the specified physical range. writes
+// to PML-backed MMRs are drained before they are removed.
+void discard_pml_entries(vcpu_ept_data& ept,
+    uint64_t const start, uint64_t const size) {
+  if (!ept.pml_enabled)
+    return;
+
+  drain_pml_mmr_entries(ept);
+
+  size_t first = 0;
+  get_pml_entries(ept, first);
+
+  // move the entries that we want to keep back to the top of the PML
+  auto next = ept_pml_entry_count;
+  for (auto i = ept_pml_entry_count; i-- > first;) {
+    auto const gpa = ept.pml[i];
+
+    if (gpa >= (start & ~0xFFFull) && gpa < start + size)
+      continue;
+
+    ept.pml[--next] = gpa;
+  }
+
+  // this will underflow to 0xFFFF if every entry was kept
+  vmx_vmwrite(VMCS_GUEST_PML_INDEX, static_cast<uint16_t>(next - 1));
+
+  // every entry that was kept has already been drained
+  ept.pml_drained = next;
+}
+
+// reset the PML so that the CPU starts logging from the top again. this
+// doesn't drain the PML.
+void reset_pml(vcpu_ept_data& ept) {
+  ept.pml_overflow = false;
+  ept.pml_drained  = ept_pml_entry_count;
+  vmx_vmwrite(VMCS_GUEST_PML_INDEX, ept_pml_entry_count - 1);
+}
+
 } // namespace hv
 
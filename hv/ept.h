@@ -5,6 +5,7 @@
 namespace hv {
 
 struct vcpu;
+struct mtrr_data;
 
 // number of PDs in the EPT paging structures
 inline constexpr size_t ept_pd_count = 64;
@@ -13,6 +14,16 @@ inline constexpr size_t ept_free_page_count = 100;
 // max number of MMRs
 inline constexpr size_t ept_mmr_count = 100;
 
+// max number of MMR pages that can have their monitoring suspended at once
+inline constexpr size_t ept_suspended_mmr_page_count = 32;
+
+// number of GPAs that fit in the page-modification log
+inline constexpr size_t ept_pml_entry_count = 512;
+
+// ignored bit in an EPT PTE that keeps a page marked as dirty (for dirty
+// logging) after its dirty flag was cleared to re-arm a PML-backed MMR
+inline constexpr uint64_t ept_pte_soft_dirty = 1ull << 11;
+
 struct vcpu_ept_hook_node {
   vcpu_ept_hook_node* next;
 
@@ -43,6 +54,40 @@ enum mmr_memory_mode {
   mmr_memory_mode_x = 0b100
 };
 
+// the mechanism that is used to monitor an MMR
+enum mmr_backend {
+  // EPT violation followed by a single-step with MTF on every access
+  mmr_backend_ept = 0,
+
+  // writes are logged by the CPU to the PML and drained on PML-full exits.
+  // this only works for write monitoring and only the GPA is recorded.
+  mmr_backend_pml,
+
+  // EPT violations are delivered to the guest as a #VE. the pages are fully
+  // accessible in the #VE view so that the guest handler can VMFUNC into
+  // it to complete the access. if the #VE can't be delivered, this
+  // falls back to mmr_backend_ept.
+  mmr_backend_ve
+};
+
+// indices into the EPTP list
+enum ept_view : uint8_t {
+  // the normal EPT paging structures where hooked pages aren't executable
+  ept_view_primary = 0,
+
+  // hooked pages are mapped execute-only to their executable page
+  ept_view_exec,
+
+  // #VE MMR pages are fully accessible. only the guest #VE handler runs here.
+  ept_view_ve
+};
+
+// number of EPTPs that are in use
+inline constexpr size_t ept_view_count = 3;
+
+// max number of PTs that can be private to a secondary view
+inline constexpr size_t ept_view_pt_count = 64;
+
 // monitored memory ranges
 struct vcpu_ept_mmr_entry {
   // start physical address
@@ -53,6 +98,62 @@ struct vcpu_ept_mmr_entry {
 
   // the memory access type that we are monitoring for
   uint8_t mode;
+
+  // mmr_backend
+  uint8_t backend;
+
+  // only log every Nth access (0 or 1 logs every access)
+  uint32_t sample_interval;
+
+  // max number of accesses that are logged per second (0 for no limit)
+  uint32_t max_events_per_sec;
+
+  // number of TSC ticks to stop monitoring a page for after it has
+  // been accessed (0 to never suspend monitoring)
+  uint64_t suspend_ticks;
+
+  // number of monitored accesses, and the number of those that were logged
+  uint64_t access_count;
+  uint64_t logged_count;
+
+  // number of accesses that weren't logged because of max_events_per_sec
+  // or because the logger stalled MMR tracing
+  uint64_t dropped_count;
+
+  // the current one second window for rate limiting
+  uint64_t window_start;
+  uint32_t window_count;
+};
+
+// an MMR page that is temporarily not being monitored
+struct vcpu_ept_suspended_mmr_page {
+  ept_pte* pte;
+
+  // TSC value to resume monitoring at
+  uint64_t resume_tsc;
+
+  // the memory access type that we are monitoring for
+  uint8_t mode;
+};
+
+// EPT paging structures for a view other than the primary one. the PDs are
+// a copy of the primary PDs, which means that every PT is shared between
+// the two views except for the PTs that contain remapped pages.
+struct ept_secondary_view {
+  alignas(0x1000) ept_pml4e pml4[512];
+  alignas(0x1000) ept_pdpte pdpt[512];
+
+  union {
+    alignas(0x1000) ept_pde     pds[ept_pd_count][512];
+    alignas(0x1000) ept_pde_2mb pds_2mb[ept_pd_count][512];
+  };
+
+  // PTs that are private to this view
+  alignas(0x1000) ept_pte pts[ept_view_pt_count][512];
+  uint64_t pt_pfns[ept_view_pt_count];
+
+  // # of private PTs that are currently in use
+  size_t num_used_pts;
 };
 
 struct vcpu_ept_data {
@@ -76,6 +177,18 @@ struct vcpu_ept_data {
   alignas(0x1000) uint8_t dummy_page[0x1000];
   uint64_t dummy_page_pfn;
 
+  // page-modification log that the CPU writes dirty GPAs to
+  alignas(0x1000) uint64_t pml[ept_pml_entry_count];
+
+  // EPT paging structures for the execute view
+  ept_secondary_view exec_view;
+
+  // EPT paging structures for the #VE view
+  ept_secondary_view ve_view;
+
+  // list of EPTPs that can be switched between with VMFUNC
+  alignas(0x1000) ept_pointer eptp_list[512];
+
   // an array of PFNs that point to each free page in the free page array
   uint64_t free_page_pfns[ept_free_page_count];
 
@@ -91,8 +204,40 @@ struct vcpu_ept_data {
   // PTE of the page that we should re-enable memory monitoring on
   ept_pte* mmr_mtf_pte;
   uint8_t  mmr_mtf_mode;
+
+  // MMR pages that will have monitoring re-enabled later on
+  vcpu_ept_suspended_mmr_page suspended_mmr_pages[ept_suspended_mmr_page_count];
+  size_t num_suspended_mmr_pages;
+
+  // physical memory range that dirty pages are being tracked for
+  bool     dirty_logging;
+  uint64_t dirty_logging_start;
+  uint64_t dirty_logging_end;
+
+  // whether EPT accessed/dirty flags and PML are currently enabled
+  bool ad_flags_enabled;
+  bool pml_enabled;
+
+  // set when the PML fills up, meaning that it no longer holds every
+  // page that has been dirtied since the last checkpoint
+  bool pml_overflow;
+
+  // PML entries at or above this index were already checked for writes
+  // to PML-backed MMRs
+  size_t pml_drained;
+
+  // GPA of the guest-provided #VE information area, or 0 if #VE is disabled
+  uint64_t ve_info_gpa;
+};
+
+// identity-mapped PDs that are built once and copied into every vcpu
+struct ept_pd_template {
+  ept_pde_2mb pds[ept_pd_count][512];
 };
 
+// build the identity-mapped PDs (and their memory types) for every vcpu
+void prepare_ept_pd_template(ept_pd_template& pd_template, mtrr_data const& mtrrs);
+
 // identity-map the EPT paging structures
 void prepare_ept(vcpu_ept_data& ept);
 
@@ -103,6 +248,18 @@ void update_ept_memory_type(vcpu_ept_data& ept);
 // set the memory type in every EPT paging structure to the specified value
 void set_ept_memory_type(vcpu_ept_data& ept, uint8_t memory_type);
 
+// rebuild the execute and #VE views from the primary EPT paging structures.
+// this returns false if there weren't enough PTs to map every hook and
+// #VE MMR.
+bool update_ept_views(vcpu_ept_data& ept);
+
+// get the EPT view that the guest is currently running in
+ept_view current_ept_view(vcpu_ept_data& ept);
+
+// switch to a different EPT view. this doesn't require an INVEPT since
+// cached translations are tagged with the EPTP that they came from.
+void set_ept_view(vcpu_ept_data& ept, ept_view view);
+
 // get the corresponding EPT PDPTE for a given physical address
 ept_pdpte* get_ept_pdpte(vcpu_ept_data& ept, uint64_t physical_address);
 
@@ -127,5 +284,50 @@ void remove_ept_hook(vcpu_ept_data& ept, uint64_t original_page_pfn);
 // find the EPT hook for the specified PFN
 vcpu_ept_hook_node* find_ept_hook(vcpu_ept_data& ept, uint64_t original_page_pfn);
 
+// enable or disable EPT accessed/dirty flags and PML depending on whether
+// they are currently needed. this function should only be called from
+// root-mode during vmx-operation.
+void update_ept_dirty_tracking(vcpu* cpu);
+
+// find the PML-backed MMR that contains the specified physical page
+vcpu_ept_mmr_entry* find_pml_mmr(vcpu_ept_data& ept, uint64_t physical_address);
+
+// stop monitoring an MMR page until the specified TSC value is reached.
+// returns false if too many pages are already suspended.
+bool suspend_mmr_page(vcpu_ept_data& ept,
+    ept_pte* pte, uint8_t mode, uint64_t resume_tsc);
+
+// re-enable monitoring on every suspended MMR page whose suspension has
+// expired. returns the TSC value that the next page should be resumed
+// at, or ~0 if there are no more suspended pages.
+uint64_t resume_suspended_mmr_pages(vcpu_ept_data& ept);
+
+// forget about any suspended MMR pages in the specified physical range
+void cancel_suspended_mmr_pages(vcpu_ept_data& ept, uint64_t start, uint64_t size);
+
+// clear the EPT dirty flag for every page in the specified physical range
+void clear_ept_dirty_flags(vcpu_ept_data& ept, uint64_t start, uint64_t size);
+
+// check whether the specified physical page was dirtied since the dirty
+// flags were last cleared
+bool is_ept_page_dirty(vcpu_ept_data& ept, uint64_t physical_address);
+
+// get the GPAs that were logged to the PML since it was last reset. returns
+// the number of valid entries, which start at pml[first].
+size_t get_pml_entries(vcpu_ept_data& ept, size_t& first);
+
+// log every write to a PML-backed MMR that was added to the PML since the
+// last drain and clear the dirty flag of the written pages, so that the
+// next write gets logged as well
+void drain_pml_mmr_entries(vcpu_ept_data& ept);
+
+// remove every PML entry that lies in the specified physical range. writes
+// to PML-backed MMRs are drained before they are removed.
+void discard_pml_entries(vcpu_ept_data& ept, uint64_t start, uint64_t size);
+
+// reset the PML so that the CPU starts logging from the top again. this
+// doesn't drain the PML.
+void reset_pml(vcpu_ept_data& ept);
+
 } // namespace hv
 
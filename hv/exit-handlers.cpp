@@ -81,6 +81,12 @@ void emulate_wrmsr(vcpu* const cpu) {
     vmx_invept(invept_all_context, {});
   }
 
+  // the PMC list depends on which events are counted and in which rings,
+  // even if the guest doesn't disable the counter while reprogramming it
+  if (msr == IA32_FIXED_CTR_CTRL || (msr >= IA32_PERFEVTSEL0 &&
+      msr < IA32_PERFEVTSEL0 + cpu->cached.gp_pmc_count))
+    cpu->pmc_perf_global_ctrl = ~0ull;
+
   cpu->hide_vm_exit_overhead = true;
   skip_instruction();
   return;
@@ -193,24 +199,41 @@ void emulate_vmcall(vcpu* const cpu) {
 
   // handle the hypercall
   switch (code) {
-  case hypercall_ping:                 hc::ping(cpu);                 return;
-  case hypercall_test:                 hc::test(cpu);                 return;
-  case hypercall_unload:               hc::unload(cpu);               return;
-  case hypercall_read_phys_mem:        hc::read_phys_mem(cpu);        return;
-  case hypercall_write_phys_mem:       hc::write_phys_mem(cpu);       return;
-  case hypercall_read_virt_mem:        hc::read_virt_mem(cpu);        return;
-  case hypercall_write_virt_mem:       hc::write_virt_mem(cpu);       return;
-  case hypercall_query_process_cr3:    hc::query_process_cr3(cpu);    return;
-  case hypercall_install_ept_hook:     hc::install_ept_hook(cpu);     return;
-  case hypercall_remove_ept_hook:      hc::remove_ept_hook(cpu);      return;
-  case hypercall_flush_logs:           hc::flush_logs(cpu);           return;
-  case hypercall_get_physical_address: hc::get_physical_address(cpu); return;
-  case hypercall_hide_physical_page:   hc::hide_physical_page(cpu);   return;
-  case hypercall_unhide_physical_page: hc::unhide_physical_page(cpu); return;
-  case hypercall_get_hv_base:          hc::get_hv_base(cpu);          return;
-  case hypercall_install_mmr:          hc::install_mmr(cpu);          return;
-  case hypercall_remove_mmr:           hc::remove_mmr(cpu);           return;
-  case hypercall_remove_all_mmrs:      hc::remove_all_mmrs(cpu);      return;
+  case hypercall_ping:                    hc::ping(cpu);                    return;
+  case hypercall_test:                    hc::test(cpu);                    return;
+  case hypercall_unload:                  hc::unload(cpu);                  return;
+  case hypercall_read_phys_mem:           hc::read_phys_mem(cpu);           return;
+  case hypercall_write_phys_mem:          hc::write_phys_mem(cpu);          return;
+  case hypercall_read_virt_mem:           hc::read_virt_mem(cpu);           return;
+  case hypercall_write_virt_mem:          hc::write_virt_mem(cpu);          return;
+  case hypercall_query_process_cr3:       hc::query_process_cr3(cpu);       return;
+  case hypercall_install_ept_hook:        hc::install_ept_hook(cpu);        return;
+  case hypercall_remove_ept_hook:         hc::remove_ept_hook(cpu);         return;
+  case hypercall_flush_logs:              hc::flush_logs(cpu);              return;
+  case hypercall_get_physical_address:    hc::get_physical_address(cpu);    return;
+  case hypercall_hide_physical_page:      hc::hide_physical_page(cpu);      return;
+  case hypercall_unhide_physical_page:    hc::unhide_physical_page(cpu);    return;
+  case hypercall_get_hv_base:             hc::get_hv_base(cpu);             return;
+  case hypercall_install_mmr:             hc::install_mmr(cpu);             return;
+  case hypercall_remove_mmr:              hc::remove_mmr(cpu);              return;
+  case hypercall_remove_all_mmrs:         hc::remove_all_mmrs(cpu);         return;
+  case hypercall_enable_dirty_logging:    hc::enable_dirty_logging(cpu);    return;
+  case hypercall_disable_dirty_logging:   hc::disable_dirty_logging(cpu);   return;
+  case hypercall_clear_dirty_pages:       hc::clear_dirty_pages(cpu);       return;
+  case hypercall_query_dirty_pages:       hc::query_dirty_pages(cpu);       return;
+  case hypercall_enable_ve:               hc::enable_ve(cpu);               return;
+  case hypercall_disable_ve:              hc::disable_ve(cpu);              return;
+  case hypercall_query_mmr_stats:         hc::query_mmr_stats(cpu);         return;
+  case hypercall_query_process_cr3_batch: hc::query_process_cr3_batch(cpu); return;
+  case hypercall_query_process_list:      hc::query_process_list(cpu);      return;
+  case hypercall_query_module_list:       hc::query_module_list(cpu);       return;
+  case hypercall_dump_module:             hc::dump_module(cpu);             return;
+  case hypercall_configure_logger:        hc::configure_logger(cpu);        return;
+  case hypercall_query_logger_stats:      hc::query_logger_stats(cpu);      return;
+  case hypercall_set_logger_channels:     hc::set_logger_channels(cpu);     return;
+  case hypercall_configure_cr3_exiting:   hc::configure_cr3_exiting(cpu);   return;
+  case hypercall_query_exit_counts:       hc::query_exit_counts(cpu);       return;
+  case hypercall_set_timing_mode:         hc::set_timing_mode(cpu);         return;
   }
 
   HV_LOG_VERBOSE("Unhandled VMCALL. RIP=%p.", vmx_vmread(VMCS_GUEST_RIP));
@@ -327,6 +350,20 @@ void emulate_mov_to_cr3(vcpu* const cpu, uint64_t const gpr) {
 
   // 3.28.4.3.3
   if (invalidate_tlb) {
+    // INVVPID can't invalidate a single PCID, so let the guest execute the
+    // MOV to CR3 itself in order to only flush the new PCID's translations
+    if (curr_cr4.pcid_enable) {
+      auto ctrl = read_ctrl_proc_based();
+      ctrl.cr3_load_exiting  = 0;
+      ctrl.monitor_trap_flag = 1;
+      write_ctrl_proc_based(ctrl);
+
+      cpu->cr3_mtf_pending       = true;
+      cpu->hide_vm_exit_overhead = true;
+      return;
+    }
+
+    // without PCIDs, every non-global translation belongs to PCID 000H
     invvpid_descriptor desc;
     desc.linear_address = 0;
     desc.reserved1      = 0;
@@ -338,6 +375,12 @@ void emulate_mov_to_cr3(vcpu* const cpu, uint64_t const gpr) {
   // it is now safe to write the new guest cr3
   vmx_vmwrite(VMCS_GUEST_CR3, new_cr3.flags);
 
+  // cached guest values might belong to a different process now
+  invalidate_introspection_cache(cpu);
+
+  // keep the process index up-to-date with the processes that are running
+  index_current_guest_process();
+
   cpu->hide_vm_exit_overhead = true;
   skip_instruction();
 }
@@ -544,6 +587,40 @@ void handle_vmx_instruction(vcpu*) {
   inject_hw_exception(invalid_opcode);
 }
 
+// count an MMR access and check whether it should be logged
+static bool sample_mmr_access(vcpu_ept_mmr_entry& entry) {
+  ++entry.access_count;
+
+  // the logger is full and asked us to stop tracing
+  if (logger_mmr_stalled()) {
+    ++entry.dropped_count;
+    return false;
+  }
+
+  if (entry.sample_interval > 1 && (entry.access_count % entry.sample_interval) != 0)
+    return false;
+
+  if (entry.max_events_per_sec) {
+    auto const tsc = __rdtsc();
+
+    // start a new one second window
+    if (tsc - entry.window_start >= ghv.tsc_frequency) {
+      entry.window_start = tsc;
+      entry.window_count = 0;
+    }
+
+    if (entry.window_count >= entry.max_events_per_sec) {
+      ++entry.dropped_count;
+      return false;
+    }
+
+    ++entry.window_count;
+  }
+
+  ++entry.logged_count;
+  return true;
+}
+
 void handle_ept_violation(vcpu* const cpu) {
   vmx_exit_qualification_ept_violation qualification;
   qualification.flags = vmx_vmread(VMCS_EXIT_QUALIFICATION);
@@ -552,9 +629,21 @@ void handle_ept_violation(vcpu* const cpu) {
   auto const physical_address = vmx_vmread(qualification.caused_by_translation ?
     VMCS_GUEST_PHYSICAL_ADDRESS : VMCS_EXIT_GUEST_LINEAR_ADDRESS);
 
+  // only hooked code is executed in the execute view and only the #VE
+  // handler runs in the #VE view, so switch back to the primary view and
+  // let the guest retry the access from there
+  if (current_ept_view(cpu->ept) != ept_view_primary) {
+    set_ept_view(cpu->ept, ept_view_primary);
+    return;
+  }
+
   auto const pte = get_ept_pte(cpu->ept, physical_address);
 
-  for (auto const& entry : cpu->ept.mmr) {
+  for (auto& entry : cpu->ept.mmr) {
+    // PML-backed MMRs never cause EPT violations
+    if (entry.backend == mmr_backend_pml)
+      continue;
+
     // ignore pages that aren't being monitored
     if (physical_address < (entry.start & ~0xFFFull))
       continue;
@@ -572,7 +661,8 @@ void handle_ept_violation(vcpu* const cpu) {
 
     if (is_relevant_mode &&
         physical_address >= entry.start &&
-        physical_address < (entry.start + entry.size)) {
+        physical_address < (entry.start + entry.size) &&
+        sample_mmr_access(entry)) {
 
       char name[16] = {};
       current_guest_image_file_name(name);
@@ -608,6 +698,11 @@ void handle_ept_violation(vcpu* const cpu) {
       HV_LOG_MMR_ACCESS("    R15:  %p", cpu->ctx->r15);
     }
 
+    // leave the page unmonitored for a while instead of single-stepping
+    if (entry.suspend_ticks && suspend_mmr_page(cpu->ept,
+        pte, entry.mode, __rdtsc() + entry.suspend_ticks))
+      return;
+
     cpu->ept.mmr_mtf_pte  = pte;
     cpu->ept.mmr_mtf_mode = entry.mode;
 
@@ -616,53 +711,47 @@ void handle_ept_violation(vcpu* const cpu) {
     return;
   }
 
-  if (qualification.execute_access &&
-     (qualification.write_access || qualification.read_access)) {
+  // hooked pages are readable and writable in the primary view, so this
+  // should only ever be caused by an instruction fetch
+  if (!qualification.execute_access ||
+      qualification.write_access || qualification.read_access) {
     HV_LOG_ERROR("Invalid EPT access combination. PhysAddr = %p.", physical_address);
     inject_hw_exception(general_protection, 0);
     return;
   }
 
-  auto const hook = find_ept_hook(cpu->ept, physical_address >> 12);
-
-  if (!hook) {
+  if (!find_ept_hook(cpu->ept, physical_address >> 12)) {
     HV_LOG_ERROR("Failed to find EPT hook. PhysAddr = %p.", physical_address);
     inject_hw_exception(general_protection, 0);
     return;
   }
 
-  if (qualification.execute_access) {
-    pte->read_access       = 0;
-    pte->write_access      = 0;
-    pte->execute_access    = 1;
-    pte->page_frame_number = hook->exec_pfn;
-  } else {
-    pte->read_access       = 1;
-    pte->write_access      = 1;
-    pte->execute_access    = 0;
-    pte->page_frame_number = hook->orig_pfn;
-  }
+  // the execute view maps this page to the executable page
+  set_ept_view(cpu->ept, ept_view_exec);
 }
 
 void emulate_rdtsc(vcpu* const cpu) {
-  auto const tsc = __rdtsc();
+  // return the guest TSC at the time of the vm-exit, so that the
+  // overhead of this vm-exit can be hidden as well
+  auto const tsc = cpu->msr_exit_store.tsc.msr_data + cpu->tsc_offset;
 
-  // return current TSC
   cpu->ctx->rax = tsc & 0xFFFFFFFF;
   cpu->ctx->rdx = (tsc >> 32) & 0xFFFFFFFF;
 
+  cpu->hide_vm_exit_overhead = true;
   skip_instruction();
 }
 
 void emulate_rdtscp(vcpu* const cpu) {
-  unsigned int aux = 0;
-  auto const tsc = __rdtscp(&aux);
+  // return the guest TSC at the time of the vm-exit, so that the
+  // overhead of this vm-exit can be hidden as well
+  auto const tsc = cpu->msr_exit_store.tsc.msr_data + cpu->tsc_offset;
 
-  // return current TSC
   cpu->ctx->rax = tsc & 0xFFFFFFFF;
   cpu->ctx->rdx = (tsc >> 32) & 0xFFFFFFFF;
-  cpu->ctx->rcx = aux;
+  cpu->ctx->rcx = __readmsr(IA32_TSC_AUX) & 0xFFFFFFFF;
 
+  cpu->hide_vm_exit_overhead = true;
   skip_instruction();
 }
 
@@ -670,6 +759,20 @@ void handle_monitor_trap_flag(vcpu* const cpu) {
   auto& pte       = cpu->ept.mmr_mtf_pte;
   auto const mode = cpu->ept.mmr_mtf_mode;
 
+  // the guest just executed a MOV to CR3
+  if (cpu->cr3_mtf_pending) {
+    cpu->cr3_mtf_pending = false;
+
+    auto ctrl = read_ctrl_proc_based();
+    ctrl.cr3_load_exiting = cpu->cr3_load_exiting;
+    write_ctrl_proc_based(ctrl);
+
+    invalidate_introspection_cache(cpu);
+    index_current_guest_process();
+
+    cpu->hide_vm_exit_overhead = true;
+  }
+
   // restore MMR mode
   if (pte) {
     pte->read_access    = !(mode & mmr_memory_mode_r);
@@ -693,5 +796,18 @@ void handle_ept_misconfiguration(vcpu*) {
   HV_LOG_ERROR("Unhandled EPT Misconfiguration: %p", phys);
 }
 
+void handle_pml_full(vcpu* const cpu) {
+  auto& ept = cpu->ept;
+
+  // the dirty flags of re-armed pages are kept in a separate bit, since
+  // the PML can't be used for dirty page queries after this exit anyway
+  drain_pml_mmr_entries(ept);
+
+  // the PML no longer holds every page that was dirtied since the last
+  // checkpoint, so dirty page queries need to fall back to walking the EPT
+  reset_pml(ept);
+  ept.pml_overflow = true;
+}
+
 } // namespace hv
 
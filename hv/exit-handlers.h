@@ -54,5 +54,7 @@ void handle_monitor_trap_flag(vcpu* cpu);
 
 void handle_ept_misconfiguration(vcpu* cpu);
 
+void handle_pml_full(vcpu* cpu);
+
 } // namespace hv
 
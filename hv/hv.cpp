@@ -2,6 +2,7 @@
 #include "vcpu.h"
 #include "mm.h"
 #include "arch.h"
+#include "timing.h"
 
 namespace hv {
 
@@ -14,6 +15,11 @@ extern "C" {
 NTKERNELAPI void PsGetCurrentThreadProcess();
 NTKERNELAPI void PsGetProcessImageFileName();
 
+// these aren't declared in any of the WDK headers
+NTKERNELAPI void KeGenericCallDpc(PKDEFERRED_ROUTINE routine, PVOID context);
+NTKERNELAPI void KeSignalCallDpcDone(PVOID system_argument1);
+NTKERNELAPI LOGICAL KeSignalCallDpcSynchronize(PVOID system_argument2);
+
 }
 
 // dynamically find the offsets for various kernel structures
@@ -23,6 +29,9 @@ static bool find_offsets() {
   ghv.kpcr_pcrb_offset                     = 0x180;
   ghv.kprcb_current_thread_offset          = 0x8;
   ghv.kapc_state_process_offset            = 0x20;
+  ghv.kldr_dll_base_offset                 = 0x30;
+  ghv.kldr_size_of_image_offset            = 0x40;
+  ghv.kldr_base_dll_name_offset            = 0x58;
 
   ghv.system_eprocess = reinterpret_cast<uint8_t*>(PsInitialSystemProcess);
 
@@ -47,6 +56,15 @@ static bool find_offsets() {
   DbgPrint("[hv] EPROCESS::UniqueProcessId offset = 0x%zX.\n",
     ghv.eprocess_unique_process_id_offset);
 
+  // ActiveProcessLinks is right after UniqueProcessId in memory. System is
+  // the first process in the list, so its Blink points to the list head.
+  auto const system_apl = reinterpret_cast<LIST_ENTRY*>(ghv.system_eprocess +
+    ghv.eprocess_unique_process_id_offset + 8);
+  ghv.ps_active_process_head = reinterpret_cast<uint8_t*>(system_apl->Blink);
+
+  DbgPrint("[hv] PsActiveProcessHead = 0x%zX.\n",
+    reinterpret_cast<size_t>(ghv.ps_active_process_head));
+
   auto const ps_get_process_image_file_name = reinterpret_cast<uint8_t*>(PsGetProcessImageFileName);
 
   // lea rax, [rcx + OFFSET]
@@ -92,33 +110,147 @@ static bool find_offsets() {
 
   DbgPrint("[hv] System CR3 = 0x%zX.\n", ghv.system_cr3.flags);
 
+  UNICODE_STRING ps_loaded_module_list_name;
+  RtlInitUnicodeString(&ps_loaded_module_list_name, L"PsLoadedModuleList");
+
+  // this isn't declared in any of the WDK headers
+  ghv.ps_loaded_module_list = reinterpret_cast<uint8_t*>(
+    MmGetSystemRoutineAddress(&ps_loaded_module_list_name));
+
+  if (!ghv.ps_loaded_module_list) {
+    DbgPrint("[hv] Failed to get PsLoadedModuleList.\n");
+    return false;
+  }
+
+  DbgPrint("[hv] PsLoadedModuleList = 0x%zX.\n",
+    reinterpret_cast<size_t>(ghv.ps_loaded_module_list));
+
   return true;
 }
 
-// allocate the hypervisor and vcpus
+// get the NUMA node that a processor belongs to
+static USHORT processor_node(ULONG const index) {
+  PROCESSOR_NUMBER number;
+  if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(index, &number)))
+    return 0;
+
+  for (USHORT node = 0; node <= KeQueryHighestNodeNumber(); ++node) {
+    GROUP_AFFINITY affinity;
+    USHORT count = 0;
+    KeQueryNodeActiveAffinity(node, &affinity, &count);
+
+    if (affinity.Group == number.Group && (affinity.Mask & (1ull << number.Number)))
+      return node;
+  }
+
+  return 0;
+}
+
+// allocate a vcpu on the same NUMA node as its processor, so that
+// vm-exits and EPT walks don't have to go through another socket. the
+// pages don't need to be physically contiguous, since every structure
+// that the CPU accesses by its physical address fits in a single page.
+static vcpu* allocate_vcpu(ULONG const index, PMDL& mdl) {
+  PHYSICAL_ADDRESS lowest, highest, skip;
+  lowest.QuadPart  = 0;
+  highest.QuadPart = MAXLONGLONG;
+  skip.QuadPart    = 0;
+
+  // the node is only a preference, which means that this falls back
+  // to a different node rather than failing completely
+  mdl = MmAllocateNodePagesForMdlEx(lowest, highest, skip, sizeof(vcpu),
+    MmCached, processor_node(index), MM_ALLOCATE_FULLY_REQUIRED);
+
+  if (!mdl)
+    return nullptr;
+
+  auto const cpu = static_cast<vcpu*>(MmMapLockedPagesSpecifyCache(mdl, KernelMode,
+    MmCached, nullptr, FALSE, NormalPagePriority | MdlMappingNoExecute));
+
+  if (!cpu) {
+    MmFreePagesFromMdl(mdl);
+    ExFreePool(mdl);
+    mdl = nullptr;
+  }
+
+  return cpu;
+}
+
+// free a vcpu that was allocated with allocate_vcpu()
+static void free_vcpu(vcpu* const cpu, PMDL const mdl) {
+  MmUnmapLockedPages(cpu, mdl);
+  MmFreePagesFromMdl(mdl);
+  ExFreePool(mdl);
+}
+
+// free everything that was allocated by create(). this also works if
+// create() failed partway through.
+static void destroy() {
+  if (ghv.vcpus) {
+    for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+      if (ghv.vcpus[i])
+        free_vcpu(ghv.vcpus[i], ghv.vcpu_mdls[i]);
+    }
+
+    ExFreePoolWithTag(ghv.vcpus, 'fr0g');
+    ghv.vcpus = nullptr;
+  }
+
+  if (ghv.vcpu_mdls) {
+    ExFreePoolWithTag(ghv.vcpu_mdls, 'fr0g');
+    ghv.vcpu_mdls = nullptr;
+  }
+
+  if (ghv.ept_template) {
+    ExFreePoolWithTag(ghv.ept_template, 'fr0g');
+    ghv.ept_template = nullptr;
+  }
+
+  logger_free();
+}
+
+// allocate the hypervisor and vcpus. destroy() needs to be called if
+// this fails.
 static bool create() {
   memset(&ghv, 0, sizeof(ghv));
 
-  logger_init();
+  if (!logger_init()) {
+    DbgPrint("[hv] Failed to allocate the logger.\n");
+    return false;
+  }
 
-  ghv.vcpu_count = KeQueryActiveProcessorCount(nullptr);
+  ghv.process_index.lock.initialize();
 
-  // size of the vcpu array
-  auto const arr_size = sizeof(vcpu) * ghv.vcpu_count;
+  // include processors from every group, since every one of them is virtualized
+  ghv.vcpu_count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
 
-  // allocate an array of vcpus
-  ghv.vcpus = static_cast<vcpu*>(ExAllocatePoolWithTag(
-    NonPagedPoolNx, arr_size, 'fr0g'));
+  // allocate an array of vcpu pointers and their MDLs
+  ghv.vcpus = static_cast<vcpu**>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, sizeof(vcpu*) * ghv.vcpu_count, 'fr0g'));
+  ghv.vcpu_mdls = static_cast<PMDL*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, sizeof(PMDL) * ghv.vcpu_count, 'fr0g'));
 
-  if (!ghv.vcpus) {
+  if (!ghv.vcpus || !ghv.vcpu_mdls) {
     DbgPrint("[hv] Failed to allocate VCPUs.\n");
     return false;
   }
 
-  // zero-initialize the vcpu array
-  memset(ghv.vcpus, 0, arr_size);
+  memset(ghv.vcpus, 0, sizeof(vcpu*) * ghv.vcpu_count);
+  memset(ghv.vcpu_mdls, 0, sizeof(PMDL) * ghv.vcpu_count);
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    ghv.vcpus[i] = allocate_vcpu(i, ghv.vcpu_mdls[i]);
+
+    if (!ghv.vcpus[i]) {
+      DbgPrint("[hv] Failed to allocate VCPU#%u.\n", i + 1);
+      return false;
+    }
+
+    // zero-initialize the vcpu
+    memset(ghv.vcpus[i], 0, sizeof(vcpu));
+  }
 
-  DbgPrint("[hv] Allocated %u VCPUs (0x%zX bytes).\n", ghv.vcpu_count, arr_size);
+  DbgPrint("[hv] Allocated %u VCPUs (0x%zX bytes each).\n", ghv.vcpu_count, sizeof(vcpu));
 
   if (!find_offsets()) {
     DbgPrint("[hv] Failed to find offsets.\n");
@@ -130,61 +262,204 @@ static bool create() {
   DbgPrint("[hv] Mapped all of physical memory to address 0x%zX.\n",
     reinterpret_cast<uint64_t>(host_physical_memory_base));
 
+  ghv.tsc_frequency = measure_tsc_frequency();
+
+  DbgPrint("[hv] Measured TSC frequency (%zu Hz).\n", ghv.tsc_frequency);
+
+  ghv.mtrrs = read_mtrr_data();
+
+  ghv.ept_template = static_cast<ept_pd_template*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, sizeof(ept_pd_template), 'fr0g'));
+
+  if (!ghv.ept_template) {
+    DbgPrint("[hv] Failed to allocate the EPT PD template.\n");
+    return false;
+  }
+
+  // this only needs to be done once instead of once per vcpu
+  prepare_ept_pd_template(*ghv.ept_template, ghv.mtrrs);
+
+  DbgPrint("[hv] Built the EPT PD template.\n");
+
   return true;
 }
 
+// the number of microseconds that have passed since start
+static uint64_t elapsed_us(LARGE_INTEGER const start) {
+  LARGE_INTEGER frequency;
+  auto const end = KeQueryPerformanceCounter(&frequency);
+  return (end.QuadPart - start.QuadPart) * 1'000'000 / frequency.QuadPart;
+}
+
+// state that is shared between every processor in start() and stop()
+struct broadcast_context {
+  // number of vcpus that failed to be virtualized
+  long volatile failed_count;
+};
+
+// called on every processor at DISPATCH_LEVEL by KeGenericCallDpc()
+static void virtualize_dpc(PKDPC, PVOID const context,
+    PVOID const system_argument1, PVOID const system_argument2) {
+  auto const bc = static_cast<broadcast_context*>(context);
+  auto const index = KeGetCurrentProcessorNumberEx(nullptr);
+
+  if (index >= ghv.vcpu_count || !virtualize_cpu(ghv.vcpus[index]))
+    InterlockedIncrement(&bc->failed_count);
+
+  // wait for every processor to finish before any of them return, so
+  // that nothing runs on a partially-virtualized system
+  KeSignalCallDpcSynchronize(system_argument2);
+  KeSignalCallDpcDone(system_argument1);
+}
+
+// called on every processor at DISPATCH_LEVEL by KeGenericCallDpc()
+static void devirtualize_dpc(PKDPC, PVOID,
+    PVOID const system_argument1, PVOID const system_argument2) {
+  // its possible that someone tried to call stop() when the hypervisor
+  // wasn't even running, so we're wrapping this in a nice try-except
+  // block. nice job.
+  __try {
+    hv::hypercall_input input;
+    input.code = hv::hypercall_unload;
+    input.key  = hv::hypercall_key;
+    vmx_vmcall(input);
+  }
+  __except (1) {}
+
+  KeSignalCallDpcSynchronize(system_argument2);
+  KeSignalCallDpcDone(system_argument1);
+}
+
+// check whether the current processor is virtualized
+static bool current_cpu_virtualized() {
+  __try {
+    hv::hypercall_input input;
+    input.code = hv::hypercall_ping;
+    input.key  = hv::hypercall_key;
+    return vmx_vmcall(input) == hypervisor_signature;
+  }
+  __except (1) {
+    return false;
+  }
+}
+
+// called at DISPATCH_LEVEL on the processor that the timer belongs to.
+// the vm-exit overhead changes with the processor's frequency, so it is
+// periodically checked to see whether it needs to be recalibrated.
+static void recalibrate_dpc(PKDPC, PVOID, PVOID, PVOID) {
+  auto const index = KeGetCurrentProcessorNumberEx(nullptr);
+
+  // processors that were added after start() don't have a vcpu
+  if (index >= ghv.vcpu_count)
+    return;
+
+  // calibrating executes VMCALL, which raises #UD outside of VMX operation
+  if (!current_cpu_virtualized())
+    return;
+
+  auto const cpu = ghv.vcpus[index];
+
+  if (vm_exit_overhead_stale(cpu))
+    calibrate_vm_exit_overhead(cpu);
+}
+
+// start recalibrating the vm-exit overhead in the background. every
+// processor has its own timer so that a processor that is recalibrating
+// never holds up the others.
+static void start_recalibration_timers() {
+  ghv.recalibration_timers = static_cast<recalibration_timer*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, sizeof(recalibration_timer) * ghv.vcpu_count, 'fr0g'));
+
+  if (!ghv.recalibration_timers) {
+    DbgPrint("[hv] Failed to allocate the recalibration timers.\n");
+    return;
+  }
+
+  LARGE_INTEGER due_time;
+  due_time.QuadPart = -10'000ll * overhead_recalibration_poll_ms;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
+    auto& rt = ghv.recalibration_timers[i];
+
+    PROCESSOR_NUMBER number;
+    KeGetProcessorNumberFromIndex(i, &number);
+
+    KeInitializeDpc(&rt.dpc, recalibrate_dpc, nullptr);
+    KeSetTargetProcessorDpcEx(&rt.dpc, &number);
+
+    // don't interrupt the target processor just to run this DPC
+    KeSetImportanceDpc(&rt.dpc, LowImportance);
+
+    KeInitializeTimer(&rt.timer);
+
+    // the timer can be coalesced with other timers, so that idle
+    // processors don't need to wake up just for this
+    KeSetCoalescableTimer(&rt.timer, due_time,
+      static_cast<ULONG>(overhead_recalibration_poll_ms),
+      static_cast<ULONG>(overhead_recalibration_tolerable_delay_ms), &rt.dpc);
+  }
+}
+
+// stop recalibrating the vm-exit overhead and wait for any DPCs to finish
+static void stop_recalibration_timers() {
+  if (!ghv.recalibration_timers)
+    return;
+
+  for (unsigned long i = 0; i < ghv.vcpu_count; ++i)
+    KeCancelTimer(&ghv.recalibration_timers[i].timer);
+
+  KeFlushQueuedDpcs();
+
+  ExFreePoolWithTag(ghv.recalibration_timers, 'fr0g');
+  ghv.recalibration_timers = nullptr;
+}
+
 // virtualize the current system
 bool start() {
-  if (!create())
+  if (!create()) {
+    destroy();
     return false;
+  }
 
-  // we need to be running at an IRQL below DISPATCH_LEVEL so
-  // that KeSetSystemAffinityThreadEx takes effect immediately
   NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
 
-  // virtualize every cpu
-  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
-    // restrict execution to the specified cpu
-    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
+  auto const start_time = KeQueryPerformanceCounter(nullptr);
 
-    if (!virtualize_cpu(&ghv.vcpus[i])) {
-      // TODO: handle this bruh -_-
-      KeRevertToUserAffinityThreadEx(orig_affinity);
-      return false;
-    }
+  // virtualize every cpu at the same time
+  broadcast_context bc = {};
+  KeGenericCallDpc(virtualize_dpc, &bc);
+
+  DbgPrint("[hv] Virtualized %u VCPUs in %zu us.\n",
+    ghv.vcpu_count - bc.failed_count, elapsed_us(start_time));
 
-    KeRevertToUserAffinityThreadEx(orig_affinity);
+  // devirtualize the vcpus that were successfully virtualized
+  if (bc.failed_count > 0) {
+    DbgPrint("[hv] Failed to virtualize %li VCPUs.\n", bc.failed_count);
+    stop();
+    return false;
   }
 
+  start_recalibration_timers();
+
   return true;
 }
 
 // devirtualize the current system
 void stop() {
-  // we need to be running at an IRQL below DISPATCH_LEVEL so
-  // that KeSetSystemAffinityThreadEx takes effect immediately
   NT_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
 
-  // virtualize every cpu
-  for (unsigned long i = 0; i < ghv.vcpu_count; ++i) {
-    // restrict execution to the specified cpu
-    auto const orig_affinity = KeSetSystemAffinityThreadEx(1ull << i);
-
-    // its possible that someone tried to call stop() when the hypervisor
-    // wasn't even running, so we're wrapping this in a nice try-except
-    // block. nice job.
-    __try {
-      hv::hypercall_input input;
-      input.code = hv::hypercall_unload;
-      input.key  = hv::hypercall_key;
-      vmx_vmcall(input);
-    }
-    __except (1) {}
+  // this needs to be done while we're still virtualized
+  stop_recalibration_timers();
 
-    KeRevertToUserAffinityThreadEx(orig_affinity);
-  }
+  auto const start_time = KeQueryPerformanceCounter(nullptr);
+
+  // devirtualize every cpu at the same time
+  KeGenericCallDpc(devirtualize_dpc, nullptr);
+
+  DbgPrint("[hv] Devirtualized %u VCPUs in %zu us.\n",
+    ghv.vcpu_count, elapsed_us(start_time));
 
-  ExFreePoolWithTag(ghv.vcpus, 'fr0g');
+  destroy();
 }
 
 } // namespace hv
@@ -4,6 +4,8 @@
 #include "hypercalls.h"
 #include "logger.h"
 #include "vmx.h"
+#include "introspection.h"
+#include "mtrr.h"
 
 #include <ntddk.h>
 
@@ -12,6 +14,12 @@ namespace hv {
 // signature that is returned by the ping hypercall
 inline constexpr uint64_t hypervisor_signature = 'fr0g';
 
+// a timer (and its DPC) that is targeted at a single processor
+struct recalibration_timer {
+  KTIMER timer;
+  KDPC   dpc;
+};
+
 struct hypervisor {
   // host page tables that are shared between vcpus
   host_page_tables host_page_tables;
@@ -19,16 +27,40 @@ struct hypervisor {
   // logger that can be used in root-mode
   logger logger;
 
-  // dynamically allocated array of vcpus
+  // dynamically allocated vcpus, each on its processor's NUMA node
   unsigned long vcpu_count;
-  struct vcpu* vcpus;
+  struct vcpu** vcpus;
+
+  // MDLs that describe the physical pages of every vcpu
+  PMDL* vcpu_mdls;
 
   // pointer to the System process
   uint8_t* system_eprocess;
 
+  // head of the EPROCESS::ActiveProcessLinks list (PsActiveProcessHead)
+  uint8_t* ps_active_process_head;
+
   // kernel CR3 value of the System process
   cr3 system_cr3;
 
+  // head of the loaded kernel module list
+  uint8_t* ps_loaded_module_list;
+
+  // number of TSC ticks per second
+  uint64_t tsc_frequency;
+
+  // MTRRs are the same on every processor, so they're only read once
+  mtrr_data mtrrs;
+
+  // identity-mapped EPT PDs that are copied into every vcpu
+  struct ept_pd_template* ept_template;
+
+  // per-processor timers that recalibrate the vm-exit overhead in the background
+  recalibration_timer* recalibration_timers;
+
+  // index that is used to quickly look up processes by their PID
+  process_index process_index;
+
   // windows specific offsets D:
   uint64_t kprocess_directory_table_base_offset;
   uint64_t eprocess_unique_process_id_offset;
@@ -37,6 +69,9 @@ struct hypervisor {
   uint64_t kprcb_current_thread_offset;
   uint64_t kthread_apc_state_offset;
   uint64_t kapc_state_process_offset;
+  uint64_t kldr_dll_base_offset;
+  uint64_t kldr_size_of_image_offset;
+  uint64_t kldr_base_dll_name_offset;
 };
 
 // global instance of the hypervisor
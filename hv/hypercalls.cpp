@@ -5,6 +5,9 @@
 #include "hv.h"
 #include "exception-routines.h"
 #include "introspection.h"
+#include "timing.h"
+
+#include <ntimage.h>
 
 // first byte at the start of the image
 extern "C" uint8_t __ImageBase;
@@ -263,52 +266,7 @@ void write_virt_mem(vcpu* const cpu) {
 
 // get the kernel CR3 value of an arbitrary process
 void query_process_cr3(vcpu* const cpu) {
-  // PID of the process to get the CR3 value of
-  auto const target_pid = cpu->ctx->rcx;
-
-  // System process
-  if (target_pid == 4) {
-    cpu->ctx->rax = ghv.system_cr3.flags;
-    skip_instruction();
-    return;
-  }
-
-  cpu->ctx->rax = 0;
-
-  // ActiveProcessLinks is right after UniqueProcessId in memory
-  auto const apl_offset = ghv.eprocess_unique_process_id_offset + 8;
-  auto const head = ghv.system_eprocess + apl_offset;
-  auto curr_entry = head;
-
-  // iterate over every EPROCESS in the APL linked list
-  do {
-    // get the next entry in the linked list
-    if (sizeof(curr_entry) != read_guest_virtual_memory(ghv.system_cr3,
-        curr_entry + offsetof(LIST_ENTRY, Flink), &curr_entry, sizeof(curr_entry)))
-      break;
-
-    // EPROCESS
-    auto const process = curr_entry - apl_offset;
-
-    // EPROCESS::UniqueProcessId
-    uint64_t pid = 0;
-    if (sizeof(pid) != read_guest_virtual_memory(ghv.system_cr3,
-        process + ghv.eprocess_unique_process_id_offset, &pid, sizeof(pid)))
-      break;
-
-    // we found the target process
-    if (target_pid == pid) {
-      // EPROCESS::DirectoryTableBase
-      uint64_t cr3 = 0;
-      if (sizeof(cr3) != read_guest_virtual_memory(ghv.system_cr3,
-          process + ghv.kprocess_directory_table_base_offset, &cr3, sizeof(cr3)))
-        break;
-
-      cpu->ctx->rax = cr3;
-      break;
-    }
-  } while (curr_entry != head);
-
+  cpu->ctx->rax = lookup_process_cr3(cpu->ctx->rcx);
   skip_instruction();
 }
 
@@ -355,7 +313,7 @@ void flush_logs(vcpu* const cpu) {
   count = min(count, l.msg_count);
 
   auto start = reinterpret_cast<uint8_t*>(&l.msgs[l.msg_start]);
-  auto size = min(l.max_msg_count - l.msg_start, count) * sizeof(l.msgs[0]);
+  auto size = min(l.msg_capacity - l.msg_start, count) * sizeof(l.msgs[0]);
 
   // read the first chunk of logs before circling back around (if needed)
   for (size_t bytes_read = 0; bytes_read < size;) {
@@ -433,7 +391,11 @@ void flush_logs(vcpu* const cpu) {
   }
 
   l.msg_count -= count;
-  l.msg_start = (l.msg_start + count) % l.max_msg_count;
+  l.msg_start = (l.msg_start + count) % l.msg_capacity;
+
+  // there's room for MMR accesses again
+  if (count > 0)
+    l.mmr_stalled = false;
 
   ctx->eax = count;
 
@@ -500,10 +462,34 @@ void install_mmr(vcpu* const cpu) {
   auto const phys = cpu->ctx->rcx;
   auto const size = static_cast<uint32_t>(cpu->ctx->rdx);
   auto const mode = static_cast<uint8_t>(cpu->ctx->r8 & 0b111);
+  auto const backend = static_cast<uint8_t>(cpu->ctx->r9);
 
   // return null by default
   cpu->ctx->rax = 0;
 
+  if (backend == mmr_backend_pml) {
+    // the PML only logs writes
+    if (mode != mmr_memory_mode_w) {
+      skip_instruction();
+      return;
+    }
+
+    // PML isn't supported on this CPU
+    if (!cpu->cached.ept_vpid_cap.ept_accessed_and_dirty_flags ||
+        !cpu->cached.procbased_ctls2_allowed1.enable_pml) {
+      skip_instruction();
+      return;
+    }
+  } else if (backend != mmr_backend_ept && backend != mmr_backend_ve) {
+    skip_instruction();
+    return;
+  }
+
+  // writes that were logged before this MMR existed shouldn't be reported
+  // as accesses to it, and their dirty flags need to be kept as soft dirty
+  if (backend == mmr_backend_pml && cpu->ept.pml_enabled)
+    drain_pml_mmr_entries(cpu->ept);
+
   // TODO: check for overlap with EPT hooking
 
   vcpu_ept_mmr_entry* entry = nullptr;
@@ -522,9 +508,20 @@ void install_mmr(vcpu* const cpu) {
     return;
   }
 
-  entry->mode  = mode;
-  entry->start = phys;
-  entry->size  = size;
+  entry->mode    = mode;
+  entry->backend = backend;
+  entry->start   = phys;
+  entry->size    = size;
+
+  // sampling and rate limiting
+  entry->sample_interval    = static_cast<uint32_t>(cpu->ctx->r10);
+  entry->max_events_per_sec = static_cast<uint32_t>(cpu->ctx->r10 >> 32);
+  entry->suspend_ticks      = cpu->ctx->r11;
+  entry->access_count       = 0;
+  entry->logged_count       = 0;
+  entry->dropped_count      = 0;
+  entry->window_start       = 0;
+  entry->window_count       = 0;
 
   for (auto addr = phys; addr < phys + size; addr += 0x1000) {
     auto const pte = get_ept_pte(cpu->ept, addr, true);
@@ -534,6 +531,10 @@ void install_mmr(vcpu* const cpu) {
       return;
     }
 
+    // the page stays fully accessible and writes are caught by the PML instead
+    if (backend == mmr_backend_pml)
+      continue;
+
     pte->read_access    = !(mode & mmr_memory_mode_r);
     pte->write_access   = !(mode & mmr_memory_mode_w);
     pte->execute_access = !(mode & mmr_memory_mode_x);
@@ -541,6 +542,46 @@ void install_mmr(vcpu* const cpu) {
     // write access but no read access will generate an EPT misconfiguration
     if (pte->write_access && !pte->read_access)
       pte->write_access = 0;
+
+    // ept-violations on this page will be delivered to the guest as a #VE
+    if (backend == mmr_backend_ve)
+      pte->suppress_ve = 0;
+  }
+
+  if (backend == mmr_backend_pml) {
+    update_ept_dirty_tracking(cpu);
+
+    // the first write to every page in the range will now be logged. pages
+    // that were dirtied since the last dirty logging checkpoint still need
+    // to show up as dirty, so clear_ept_dirty_flags() can't be used here.
+    for (auto addr = phys; addr < phys + size; addr += 0x1000) {
+      auto const pte = get_ept_pte(cpu->ept, addr);
+
+      if (pte->dirty)
+        pte->flags |= ept_pte_soft_dirty;
+
+      pte->dirty = 0;
+    }
+  }
+
+  // the #VE view ran out of PTs to map this range with
+  if (backend == mmr_backend_ve && !update_ept_views(cpu->ept)) {
+    for (auto addr = phys; addr < phys + size; addr += 0x1000) {
+      auto const pte = get_ept_pte(cpu->ept, addr);
+
+      pte->read_access    = 1;
+      pte->write_access   = 1;
+      pte->execute_access = 1;
+      pte->suppress_ve    = 1;
+    }
+
+    entry->size = 0;
+    update_ept_views(cpu->ept);
+
+    vmx_invept(invept_all_context, {});
+
+    skip_instruction();
+    return;
   }
 
   vmx_invept(invept_all_context, {});
@@ -564,9 +605,20 @@ void remove_mmr(vcpu* cpu) {
     pte->read_access    = 1;
     pte->write_access   = 1;
     pte->execute_access = 1;
+    pte->suppress_ve    = 1;
   }
 
+  cancel_suspended_mmr_pages(cpu->ept, entry->start, entry->size);
   entry->size = 0;
+
+  // disable PML if this was the last PML-backed MMR
+  if (entry->backend == mmr_backend_pml)
+    update_ept_dirty_tracking(cpu);
+
+  // the #VE view no longer needs to map this range
+  if (entry->backend == mmr_backend_ve)
+    update_ept_views(cpu->ept);
+
   vmx_invept(invept_all_context, {});
 
   skip_instruction();
@@ -589,12 +641,803 @@ void remove_all_mmrs(vcpu* const cpu) {
       pte->read_access    = 1;
       pte->write_access   = 1;
       pte->execute_access = 1;
+      pte->suppress_ve    = 1;
     }
 
     entry.size = 0;
   }
 
+  cpu->ept.num_suspended_mmr_pages = 0;
+
+  update_ept_dirty_tracking(cpu);
+  update_ept_views(cpu->ept);
+
+  vmx_invept(invept_all_context, {});
+  skip_instruction();
+}
+
+// OR a byte into a guest buffer. returns false if an exception
+// was injected into the guest.
+static bool or_guest_byte(vcpu* const cpu,
+    uint8_t* const dst, uint8_t const value) {
+  auto const curr_dst = gva2hva(dst);
+
+  if (!curr_dst) {
+    // guest virtual address that caused the fault
+    cpu->ctx->cr2 = reinterpret_cast<uint64_t>(dst);
+
+    page_fault_exception error;
+    error.flags            = 0;
+    error.present          = 0;
+    error.write            = 1;
+    error.user_mode_access = (current_guest_cpl() == 3);
+
+    inject_hw_exception(page_fault, error.flags);
+    return false;
+  }
+
+  uint8_t curr_value = 0;
+
+  host_exception_info e;
+  memcpy_safe(e, &curr_value, curr_dst, 1);
+
+  if (!e.exception_occurred) {
+    curr_value |= value;
+    memcpy_safe(e, curr_dst, &curr_value, 1);
+  }
+
+  if (e.exception_occurred) {
+    inject_hw_exception(general_protection, 0);
+    return false;
+  }
+
+  return true;
+}
+
+// start tracking which pages in a physical memory range are written to
+void enable_dirty_logging(vcpu* const cpu) {
+  auto& ept = cpu->ept;
+
+  auto const start = cpu->ctx->rcx & ~0xFFFull;
+  auto const end   = cpu->ctx->rcx + cpu->ctx->rdx;
+
+  // return false by default
+  cpu->ctx->rax = 0;
+
+  // EPT accessed/dirty flags aren't supported on this CPU
+  if (!cpu->cached.ept_vpid_cap.ept_accessed_and_dirty_flags) {
+    skip_instruction();
+    return;
+  }
+
+  // split every PDE in the range so that pages are tracked at a 4KB granularity
+  for (auto addr = start; addr < end; addr += 0x1000) {
+    if (!get_ept_pte(ept, addr, true)) {
+      skip_instruction();
+      return;
+    }
+  }
+
+  ept.dirty_logging       = true;
+  ept.dirty_logging_start = start;
+  ept.dirty_logging_end   = end;
+
+  update_ept_dirty_tracking(cpu);
+
+  // start with every page in the range marked as clean. the PML is drained
+  // first, since draining can mark re-armed MMR pages as dirty.
+  discard_pml_entries(ept, start, end - start);
+  clear_ept_dirty_flags(ept, start, end - start);
+  ept.pml_overflow = false;
+
   vmx_invept(invept_all_context, {});
+
+  cpu->ctx->rax = 1;
+  skip_instruction();
+}
+
+// stop tracking dirty pages
+void disable_dirty_logging(vcpu* const cpu) {
+  cpu->ept.dirty_logging = false;
+  update_ept_dirty_tracking(cpu);
+
+  skip_instruction();
+}
+
+// start a new checkpoint by marking every page in a range as clean
+void clear_dirty_pages(vcpu* const cpu) {
+  auto& ept = cpu->ept;
+
+  if (!ept.dirty_logging) {
+    skip_instruction();
+    return;
+  }
+
+  // only pages in the tracked range can be cleared
+  auto const start = max(cpu->ctx->rcx & ~0xFFFull, ept.dirty_logging_start);
+  auto const end   = min(cpu->ctx->rcx + cpu->ctx->rdx, ept.dirty_logging_end);
+
+  if (start < end) {
+    discard_pml_entries(ept, start, end - start);
+    clear_ept_dirty_flags(ept, start, end - start);
+
+    // the PML is accurate again once the entire range has been cleared
+    if (start <= ept.dirty_logging_start && end >= ept.dirty_logging_end)
+      ept.pml_overflow = false;
+
+    vmx_invept(invept_all_context, {});
+  }
+
+  skip_instruction();
+}
+
+// OR the dirty page bitmap for a physical memory range into a buffer
+void query_dirty_pages(vcpu* const cpu) {
+  auto& ept = cpu->ept;
+
+  // arguments
+  auto const start  = cpu->ctx->rcx & ~0xFFFull;
+  auto const end    = cpu->ctx->rcx + cpu->ctx->rdx;
+  auto const bitmap = reinterpret_cast<uint8_t*>(cpu->ctx->r8);
+
+  cpu->ctx->rax = 0;
+
+  if (!ept.dirty_logging) {
+    skip_instruction();
+    return;
+  }
+
+  size_t count = 0;
+
+  // the PML holds every page that was dirtied since the last checkpoint,
+  // which is a lot cheaper than walking every PTE in the range
+  if (ept.pml_enabled && !ept.pml_overflow) {
+    size_t first = 0;
+    get_pml_entries(ept, first);
+
+    for (auto i = first; i < ept_pml_entry_count; ++i) {
+      auto const gpa = ept.pml[i];
+
+      if (gpa < start || gpa >= end)
+        continue;
+
+      auto const idx = (gpa - start) >> 12;
+      if (!or_guest_byte(cpu, bitmap + idx / 8,
+          static_cast<uint8_t>(1 << (idx % 8))))
+        return;
+
+      ++count;
+    }
+
+    cpu->ctx->rax = count;
+    skip_instruction();
+    return;
+  }
+
+  // bit i in the bitmap corresponds to the page at start + i * 0x1000
+  for (uint64_t idx = 0; start + (idx << 12) < end; idx += 8) {
+    uint8_t value = 0;
+
+    for (uint64_t j = 0; j < 8; ++j) {
+      auto const addr = start + ((idx + j) << 12);
+
+      if (addr >= end)
+        break;
+
+      if (is_ept_page_dirty(ept, addr)) {
+        value |= static_cast<uint8_t>(1 << j);
+        ++count;
+      }
+    }
+
+    if (value && !or_guest_byte(cpu, bitmap + idx / 8, value))
+      return;
+  }
+
+  cpu->ctx->rax = count;
+  skip_instruction();
+}
+
+// deliver ept-violations for #VE MMRs to the guest as a #VE
+void enable_ve(vcpu* const cpu) {
+  auto const ve_info = reinterpret_cast<void*>(cpu->ctx->rcx);
+
+  // return false by default
+  cpu->ctx->rax = 0;
+
+  // ept-violation #VE isn't supported on this CPU
+  if (!cpu->cached.procbased_ctls2_allowed1.ept_violation) {
+    skip_instruction();
+    return;
+  }
+
+  // the VE information area needs to be page-aligned
+  if (cpu->ctx->rcx & 0xFFF) {
+    skip_instruction();
+    return;
+  }
+
+  auto const gpa = gva2gpa(ve_info);
+  if (!gpa) {
+    skip_instruction();
+    return;
+  }
+
+  cpu->ept.ve_info_gpa = gpa;
+
+  // 3.24.6.19
+  vmx_vmwrite(VMCS_CTRL_VIRTUALIZATION_EXCEPTION_INFORMATION_ADDRESS, gpa);
+  vmx_vmwrite(VMCS_CTRL_EPTP_INDEX, current_ept_view(cpu->ept));
+
+  // the #VE handler switches EPT views with VMFUNC. this is only enabled
+  // while #VE is enabled, since VMFUNC would otherwise let any guest code
+  // switch to a view where the #VE MMR pages aren't monitored.
+  auto ctrl = read_ctrl_proc_based2();
+  ctrl.ept_violation       = 1;
+  ctrl.enable_vm_functions = cpu->cached.vmfunc.eptp_switching;
+  write_ctrl_proc_based2(ctrl);
+
+  cpu->ctx->rax = 1;
+  skip_instruction();
+}
+
+// stop delivering ept-violations to the guest as a #VE
+void disable_ve(vcpu* const cpu) {
+  auto ctrl = read_ctrl_proc_based2();
+  ctrl.ept_violation       = 0;
+  ctrl.enable_vm_functions = 0;
+  write_ctrl_proc_based2(ctrl);
+
+  // VMFUNC could have left the guest in a different view
+  set_ept_view(cpu->ept, ept_view_primary);
+
+  cpu->ept.ve_info_gpa = 0;
+
+  skip_instruction();
+}
+
+// sequentially writes to a guest buffer. the guest buffer is only
+// translated again once the current page has been filled up.
+struct guest_writer {
+  vcpu*    cpu;
+
+  // next guest virtual address to write to
+  uint8_t* dst;
+
+  // HVA of dst and the number of bytes left in the current page
+  uint8_t* curr_hva;
+  size_t   curr_remaining;
+};
+
+// append a hypervisor buffer to a guest buffer. returns false if an
+// exception was injected into the guest.
+static bool write_to_guest(guest_writer& writer,
+    void const* const src, size_t const size) {
+  for (size_t bytes_copied = 0; bytes_copied < size;) {
+    if (writer.curr_remaining == 0) {
+      // translate the guest buffer into hypervisor space
+      writer.curr_hva = static_cast<uint8_t*>(
+        gva2hva(writer.dst, &writer.curr_remaining));
+
+      if (!writer.curr_hva) {
+        // guest virtual address that caused the fault
+        writer.cpu->ctx->cr2 = reinterpret_cast<uint64_t>(writer.dst);
+
+        page_fault_exception error;
+        error.flags            = 0;
+        error.present          = 0;
+        error.write            = 1;
+        error.user_mode_access = (current_guest_cpl() == 3);
+
+        inject_hw_exception(page_fault, error.flags);
+        return false;
+      }
+    }
+
+    auto const curr_size = min(size - bytes_copied, writer.curr_remaining);
+
+    host_exception_info e;
+    memcpy_safe(e, writer.curr_hva, static_cast<uint8_t const*>(src) + bytes_copied, curr_size);
+
+    if (e.exception_occurred) {
+      inject_hw_exception(general_protection, 0);
+      return false;
+    }
+
+    bytes_copied          += curr_size;
+    writer.dst            += curr_size;
+    writer.curr_hva       += curr_size;
+    writer.curr_remaining -= curr_size;
+  }
+
+  return true;
+}
+
+// copy a hypervisor buffer into guest memory. returns false if an
+// exception was injected into the guest.
+static bool copy_to_guest(vcpu* const cpu,
+    uint8_t* const dst, void const* const src, size_t const size) {
+  guest_writer writer = { cpu, dst, nullptr, 0 };
+  return write_to_guest(writer, src, size);
+}
+
+// get the number of accesses that were logged or dropped for an MMR
+void query_mmr_stats(vcpu* const cpu) {
+  auto const entry = reinterpret_cast<vcpu_ept_mmr_entry*>(cpu->ctx->rcx);
+  auto const dst   = reinterpret_cast<uint8_t*>(cpu->ctx->rdx);
+
+  // return false by default
+  cpu->ctx->rax = 0;
+
+  // make sure that this is actually a handle to one of our MMRs
+  if (entry < &cpu->ept.mmr[0] || entry >= &cpu->ept.mmr[ept_mmr_count] ||
+      entry->size == 0) {
+    skip_instruction();
+    return;
+  }
+
+  mmr_stats stats;
+  stats.access_count  = entry->access_count;
+  stats.logged_count  = entry->logged_count;
+  stats.dropped_count = entry->dropped_count;
+
+  if (!copy_to_guest(cpu, dst, &stats, sizeof(stats)))
+    return;
+
+  cpu->ctx->rax = 1;
+  skip_instruction();
+}
+
+// get the kernel CR3 values of an array of processes
+void query_process_cr3_batch(vcpu* const cpu) {
+  auto const pids  = reinterpret_cast<uint8_t*>(cpu->ctx->rcx);
+  auto const cr3s  = reinterpret_cast<uint8_t*>(cpu->ctx->rdx);
+  auto const count = cpu->ctx->r8;
+
+  // resolve the PIDs in small chunks to avoid translating every element
+  constexpr size_t chunk_size = 32;
+
+  size_t resolved = 0;
+
+  for (size_t i = 0; i < count; i += chunk_size) {
+    auto const curr_count = min(chunk_size, count - i);
+
+    uint64_t chunk[chunk_size];
+    auto const bytes_read = read_guest_virtual_memory(
+      pids + i * sizeof(uint64_t), chunk, curr_count * sizeof(uint64_t));
+
+    // the PID array is paged out or invalid
+    if (bytes_read != curr_count * sizeof(uint64_t)) {
+      cpu->ctx->cr2 = reinterpret_cast<uint64_t>(pids + i * sizeof(uint64_t) + bytes_read);
+
+      page_fault_exception error;
+      error.flags            = 0;
+      error.present          = 0;
+      error.write            = 0;
+      error.user_mode_access = (current_guest_cpl() == 3);
+
+      inject_hw_exception(page_fault, error.flags);
+      return;
+    }
+
+    for (size_t j = 0; j < curr_count; ++j) {
+      chunk[j] = lookup_process_cr3(chunk[j]);
+      resolved += (chunk[j] != 0);
+    }
+
+    if (!copy_to_guest(cpu, cr3s + i * sizeof(uint64_t),
+        chunk, curr_count * sizeof(uint64_t)))
+      return;
+  }
+
+  cpu->ctx->rax = resolved;
+  skip_instruction();
+}
+
+// get a snapshot of every process that is currently running
+void query_process_list(vcpu* const cpu) {
+  guest_writer writer = { cpu, reinterpret_cast<uint8_t*>(cpu->ctx->rcx), nullptr, 0 };
+  auto const max_count = cpu->ctx->rdx;
+
+  // ActiveProcessLinks is right after UniqueProcessId in memory
+  auto const apl_offset = ghv.eprocess_unique_process_id_offset + 8;
+  auto const head = ghv.ps_active_process_head;
+  auto curr_entry = head;
+
+  uint64_t count = 0;
+
+  // iterate over every EPROCESS in the APL linked list, starting with System
+  while (true) {
+    // get the next entry in the linked list
+    if (sizeof(curr_entry) != read_guest_virtual_memory(ghv.system_cr3,
+        curr_entry + offsetof(LIST_ENTRY, Flink), &curr_entry, sizeof(curr_entry)))
+      break;
+
+    // the list head isn't part of an EPROCESS
+    if (curr_entry == head)
+      break;
+
+    // EPROCESS
+    auto const process = curr_entry - apl_offset;
+
+    process_info info = {};
+    info.eprocess = reinterpret_cast<uint64_t>(process);
+
+    // EPROCESS::UniqueProcessId
+    if (sizeof(info.pid) != read_guest_virtual_memory(ghv.system_cr3,
+        process + ghv.eprocess_unique_process_id_offset, &info.pid, sizeof(info.pid)))
+      break;
+
+    // EPROCESS::DirectoryTableBase
+    if (sizeof(info.cr3) != read_guest_virtual_memory(ghv.system_cr3,
+        process + ghv.kprocess_directory_table_base_offset, &info.cr3, sizeof(info.cr3)))
+      break;
+
+    // EPROCESS::ImageFileName
+    read_guest_virtual_memory(ghv.system_cr3,
+      process + ghv.eprocess_image_file_name, info.image_file_name, 15);
+
+    // keep counting after the buffer is full so that the caller
+    // knows how large of a buffer is needed
+    if (count < max_count && !write_to_guest(writer, &info, sizeof(info)))
+      return;
+
+    ++count;
+  }
+
+  cpu->ctx->rax = count;
+  skip_instruction();
+}
+
+// read a KLDR_DATA_TABLE_ENTRY from the PsLoadedModuleList
+static bool read_loaded_module(uint8_t* const entry, module_info& info) {
+  memset(&info, 0, sizeof(info));
+
+  // KLDR_DATA_TABLE_ENTRY::DllBase
+  if (sizeof(info.base) != read_guest_virtual_memory(ghv.system_cr3,
+      entry + ghv.kldr_dll_base_offset, &info.base, sizeof(info.base)))
+    return false;
+
+  // KLDR_DATA_TABLE_ENTRY::SizeOfImage
+  uint32_t size = 0;
+  if (sizeof(size) != read_guest_virtual_memory(ghv.system_cr3,
+      entry + ghv.kldr_size_of_image_offset, &size, sizeof(size)))
+    return false;
+
+  info.size = size;
+
+  // KLDR_DATA_TABLE_ENTRY::BaseDllName
+  UNICODE_STRING name = {};
+  if (sizeof(name) != read_guest_virtual_memory(ghv.system_cr3,
+      entry + ghv.kldr_base_dll_name_offset, &name, sizeof(name)))
+    return false;
+
+  wchar_t wide_name[sizeof(info.name)] = {};
+  auto const length = min(static_cast<size_t>(name.Length / 2), sizeof(info.name) - 1);
+
+  read_guest_virtual_memory(ghv.system_cr3,
+    name.Buffer, wide_name, length * sizeof(wchar_t));
+
+  // the name is truncated to ASCII
+  for (size_t i = 0; i < length; ++i)
+    info.name[i] = static_cast<char>(wide_name[i]);
+
+  return true;
+}
+
+// get the next entry in the PsLoadedModuleList, or null if the end was reached
+static uint8_t* next_loaded_module(uint8_t* const entry) {
+  // KLDR_DATA_TABLE_ENTRY::InLoadOrderLinks is the first field
+  uint8_t* next = nullptr;
+  if (sizeof(next) != read_guest_virtual_memory(ghv.system_cr3,
+      entry + offsetof(LIST_ENTRY, Flink), &next, sizeof(next)))
+    return nullptr;
+
+  if (next == ghv.ps_loaded_module_list)
+    return nullptr;
+
+  return next;
+}
+
+// get a snapshot of every kernel module that is currently loaded
+void query_module_list(vcpu* const cpu) {
+  guest_writer writer = { cpu, reinterpret_cast<uint8_t*>(cpu->ctx->rcx), nullptr, 0 };
+  auto const max_count = cpu->ctx->rdx;
+
+  uint64_t count = 0;
+
+  for (auto entry = next_loaded_module(ghv.ps_loaded_module_list);
+       entry; entry = next_loaded_module(entry)) {
+    module_info info;
+    if (!read_loaded_module(entry, info))
+      break;
+
+    // keep counting after the buffer is full so that the caller
+    // knows how large of a buffer is needed
+    if (count < max_count && !write_to_guest(writer, &info, sizeof(info)))
+      return;
+
+    ++count;
+  }
+
+  cpu->ctx->rax = count;
+  skip_instruction();
+}
+
+// copy the part of a fixed up header field that overlaps with the dumped
+// chunk [offset, offset + size). returns false if an exception was injected.
+static bool fix_dumped_field(vcpu* const cpu, uint8_t* const dst,
+    size_t const offset, size_t const size, size_t const field_offset,
+    void const* const value, size_t const value_size) {
+  auto const start = max(offset, field_offset);
+  auto const end   = min(offset + size, field_offset + value_size);
+
+  if (start >= end)
+    return true;
+
+  return copy_to_guest(cpu, dst + (start - offset),
+    static_cast<uint8_t const*>(value) + (start - field_offset), end - start);
+}
+
+// copy part of a loaded kernel module into a guest buffer and fix up its
+// PE headers so that it can be opened in a disassembler
+void dump_module(vcpu* const cpu) {
+  auto const base   = cpu->ctx->rcx;
+  auto const dst    = reinterpret_cast<uint8_t*>(cpu->ctx->rdx);
+  auto const offset = cpu->ctx->r8;
+  auto const size   = cpu->ctx->r9;
+
+  // session-space images are only mapped in the address space of a process
+  // in that session, so the caller can provide a CR3 to read them through
+  cr3 image_cr3 = ghv.system_cr3;
+  if (cpu->ctx->r10)
+    image_cr3.flags = cpu->ctx->r10;
+
+  module_info info = {};
+
+  // look up the module so that we know how large the image is
+  for (auto entry = next_loaded_module(ghv.ps_loaded_module_list);
+       entry; entry = next_loaded_module(entry)) {
+    if (read_loaded_module(entry, info) && info.base == base)
+      break;
+
+    info.base = 0;
+  }
+
+  // return 0 on failure, or the image size otherwise
+  cpu->ctx->rax = 0;
+
+  // only a bounded chunk is copied in every vm-exit, since the guest is
+  // stuck on this processor (with interrupts disabled) until we're done
+  if (!info.base || size > dump_module_max_size ||
+      offset > info.size || size > info.size - offset) {
+    skip_instruction();
+    return;
+  }
+
+  auto const src = reinterpret_cast<uint8_t*>(base);
+
+  // the headers have to be readable, or we'd return a zeroed or un-fixed image
+  IMAGE_DOS_HEADER dos_header = {};
+  if (sizeof(dos_header) != read_guest_virtual_memory(
+      image_cr3, src, &dos_header, sizeof(dos_header)) ||
+      dos_header.e_magic != IMAGE_DOS_SIGNATURE) {
+    skip_instruction();
+    return;
+  }
+
+  auto const e_lfanew = dos_header.e_lfanew;
+  if (e_lfanew <= 0 || e_lfanew + sizeof(IMAGE_NT_HEADERS64) > info.size) {
+    skip_instruction();
+    return;
+  }
+
+  // IMAGE_NT_HEADERS64::Signature and IMAGE_NT_HEADERS64::FileHeader
+  uint32_t signature = 0;
+  IMAGE_FILE_HEADER file_header = {};
+
+  if (sizeof(signature) != read_guest_virtual_memory(image_cr3,
+      src + e_lfanew, &signature, sizeof(signature)) ||
+      signature != IMAGE_NT_SIGNATURE ||
+      sizeof(file_header) != read_guest_virtual_memory(image_cr3,
+      src + e_lfanew + offsetof(IMAGE_NT_HEADERS64, FileHeader),
+      &file_header, sizeof(file_header))) {
+    skip_instruction();
+    return;
+  }
+
+  guest_writer writer = { cpu, dst, nullptr, 0 };
+
+  // copy the chunk in small pieces since the host stack is tiny
+  for (size_t copied = 0; copied < size;) {
+    uint8_t piece[0x200];
+    auto const curr_size = min(sizeof(piece), size - copied);
+
+    // pages that aren't present (e.g. discarded INIT sections) are zeroed
+    auto const bytes_read = read_guest_virtual_memory(
+      image_cr3, src + offset + copied, piece, curr_size);
+    memset(piece + bytes_read, 0, curr_size - bytes_read);
+
+    if (!write_to_guest(writer, piece, curr_size))
+      return;
+
+    copied += curr_size;
+  }
+
+  // fix the imagebase field in the PE header
+  if (!fix_dumped_field(cpu, dst, offset, size, e_lfanew +
+      offsetof(IMAGE_NT_HEADERS64, OptionalHeader.ImageBase), &base, sizeof(base)))
+    return;
+
+  auto const sections_offset = e_lfanew +
+    offsetof(IMAGE_NT_HEADERS64, OptionalHeader) + file_header.SizeOfOptionalHeader;
+
+  // fix the sections, since the image is dumped in its mapped layout
+  for (size_t i = 0; i < file_header.NumberOfSections; ++i) {
+    auto const section_offset = sections_offset + i * sizeof(IMAGE_SECTION_HEADER);
+    if (section_offset + sizeof(IMAGE_SECTION_HEADER) > info.size)
+      break;
+
+    auto const field_offset = section_offset +
+      offsetof(IMAGE_SECTION_HEADER, PointerToRawData);
+
+    // this section header isn't in the current chunk
+    if (field_offset + sizeof(uint32_t) <= offset || field_offset >= offset + size)
+      continue;
+
+    // IMAGE_SECTION_HEADER::VirtualAddress
+    uint32_t virtual_address = 0;
+    read_guest_virtual_memory(image_cr3, src + section_offset +
+      offsetof(IMAGE_SECTION_HEADER, VirtualAddress), &virtual_address, sizeof(virtual_address));
+
+    // IMAGE_SECTION_HEADER::PointerToRawData
+    if (!fix_dumped_field(cpu, dst, offset, size, field_offset,
+        &virtual_address, sizeof(virtual_address)))
+      return;
+  }
+
+  cpu->ctx->rax = info.size;
+  skip_instruction();
+}
+
+// resize the hypervisor log and change what happens when it overflows
+void configure_logger(vcpu* const cpu) {
+  auto const capacity = static_cast<uint32_t>(cpu->ctx->rcx);
+  auto const policy   = cpu->ctx->rdx;
+
+  if (policy > logger_overflow_stall_mmr) {
+    cpu->ctx->rax = 0;
+    skip_instruction();
+    return;
+  }
+
+  logger_configure(capacity, static_cast<logger_overflow_policy>(policy));
+
+  cpu->ctx->rax = 1;
+  skip_instruction();
+}
+
+// get the size of the hypervisor log and the number of messages that were lost
+void query_logger_stats(vcpu* const cpu) {
+  auto const dst = reinterpret_cast<uint8_t*>(cpu->ctx->rcx);
+  auto& l = ghv.logger;
+
+  logger_stats stats;
+
+  {
+    scoped_spin_lock lock(l.lock);
+
+    stats.total_msg_count = l.total_msg_count;
+    stats.msg_count       = l.msg_count;
+    stats.msg_capacity    = l.msg_capacity;
+    stats.policy          = l.policy;
+    stats.mmr_stalled     = l.mmr_stalled;
+
+    memcpy(stats.dropped_msg_count, l.dropped_msg_count, sizeof(l.dropped_msg_count));
+  }
+
+  if (!copy_to_guest(cpu, dst, &stats, sizeof(stats)))
+    return;
+
+  skip_instruction();
+}
+
+// enable or disable logger channels at runtime
+void set_logger_channels(vcpu* const cpu) {
+  cpu->ctx->rax = logger_channel_mask;
+  logger_channel_mask = static_cast<uint32_t>(cpu->ctx->rcx);
+
+  skip_instruction();
+}
+
+// enable or disable CR3-load exiting on the current vcpu
+void configure_cr3_exiting(vcpu* const cpu) {
+  auto const enable  = cpu->ctx->rcx != 0;
+  auto const targets = reinterpret_cast<uint8_t*>(cpu->ctx->rdx);
+  auto const count   = cpu->ctx->r8;
+  auto const replace = cpu->ctx->r9 != 0;
+
+  // the System CR3 stays in the first target slot unless it is replaced
+  size_t const first = replace ? 0 : 1;
+
+  // 3.24.6.7
+  static constexpr uint64_t target_value_fields[] = {
+    VMCS_CTRL_CR3_TARGET_VALUE_0,
+    VMCS_CTRL_CR3_TARGET_VALUE_1,
+    VMCS_CTRL_CR3_TARGET_VALUE_2,
+    VMCS_CTRL_CR3_TARGET_VALUE_3
+  };
+
+  if (first + count > min(cpu->cached.vmx_misc.cr3_target_count,
+      sizeof(target_value_fields) / sizeof(target_value_fields[0]))) {
+    cpu->ctx->rax = 0;
+    skip_instruction();
+    return;
+  }
+
+  uint64_t values[4] = { ghv.system_cr3.flags };
+  auto const bytes_read = read_guest_virtual_memory(
+    targets, values + first, count * sizeof(uint64_t));
+
+  if (bytes_read != count * sizeof(uint64_t)) {
+    cpu->ctx->cr2 = reinterpret_cast<uint64_t>(targets + bytes_read);
+
+    page_fault_exception error;
+    error.flags            = 0;
+    error.present          = 0;
+    error.write            = 0;
+    error.user_mode_access = (current_guest_cpl() == 3);
+
+    inject_hw_exception(page_fault, error.flags);
+    return;
+  }
+
+  // MOV to CR3 doesn't cause a vm-exit for any of these values
+  vmx_vmwrite(VMCS_CTRL_CR3_TARGET_COUNT, first + count);
+  for (size_t i = 0; i < first + count; ++i)
+    vmx_vmwrite(target_value_fields[i], values[i]);
+
+  auto ctrl = read_ctrl_proc_based();
+  ctrl.cr3_load_exiting = enable;
+  write_ctrl_proc_based(ctrl);
+
+  cpu->cr3_load_exiting    = enable;
+  cpu->last_seen_guest_cr3 = 0;
+
+  cpu->ctx->rax = 1;
+  skip_instruction();
+}
+
+// get the number of vm-exits for every exit reason on the current vcpu
+void query_exit_counts(vcpu* const cpu) {
+  auto const dst   = reinterpret_cast<uint8_t*>(cpu->ctx->rcx);
+  auto const count = min(cpu->ctx->rdx, vm_exit_reason_count);
+  auto const reset = cpu->ctx->r8 != 0;
+
+  if (!copy_to_guest(cpu, dst, cpu->exit_reason_counts, count * sizeof(uint64_t)))
+    return;
+
+  if (reset)
+    memset(cpu->exit_reason_counts, 0, sizeof(cpu->exit_reason_counts));
+
+  cpu->ctx->rax = vm_exit_reason_count;
+  skip_instruction();
+}
+
+// change how vm-exit overhead is hidden from RDTSC on the current vcpu
+void set_timing_mode(vcpu* const cpu) {
+  auto const mode         = cpu->ctx->rcx;
+  auto const window_ticks = cpu->ctx->rdx;
+
+  if (mode > timing_mode_exit) {
+    cpu->ctx->rax = 0;
+    skip_instruction();
+    return;
+  }
+
+  hv::set_timing_mode(cpu, static_cast<timing_mode>(mode), window_ticks);
+
+  cpu->ctx->rax = 1;
   skip_instruction();
 }
 
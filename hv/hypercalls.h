@@ -1,5 +1,7 @@
 #pragma once
 
+#include "logger.h"
+
 #include <ia32.hpp>
 
 namespace hv {
@@ -10,6 +12,9 @@ struct vcpu;
 // TODO: compute this at runtime
 inline constexpr uint64_t hypercall_key = 69420;
 
+// the most bytes that dump_module() copies in a single hypercall
+inline constexpr uint64_t dump_module_max_size = 0x10000;
+
 // hypercall indices
 enum hypercall_code : uint64_t {
   hypercall_ping = 0,
@@ -29,7 +34,24 @@ enum hypercall_code : uint64_t {
   hypercall_get_hv_base,
   hypercall_install_mmr,
   hypercall_remove_mmr,
-  hypercall_remove_all_mmrs
+  hypercall_remove_all_mmrs,
+  hypercall_enable_dirty_logging,
+  hypercall_disable_dirty_logging,
+  hypercall_clear_dirty_pages,
+  hypercall_query_dirty_pages,
+  hypercall_enable_ve,
+  hypercall_disable_ve,
+  hypercall_query_mmr_stats,
+  hypercall_query_process_cr3_batch,
+  hypercall_query_process_list,
+  hypercall_query_module_list,
+  hypercall_dump_module,
+  hypercall_configure_logger,
+  hypercall_query_logger_stats,
+  hypercall_set_logger_channels,
+  hypercall_configure_cr3_exiting,
+  hypercall_query_exit_counts,
+  hypercall_set_timing_mode
 };
 
 // hypercall input
@@ -44,6 +66,58 @@ struct hypercall_input {
   uint64_t args[6];
 };
 
+// MMR statistics that are returned by the query_mmr_stats hypercall
+struct mmr_stats {
+  // number of monitored accesses
+  uint64_t access_count;
+
+  // number of accesses that were logged
+  uint64_t logged_count;
+
+  // number of accesses that were dropped because of rate limiting
+  // (or because the logger was full with logger_overflow_stall_mmr)
+  uint64_t dropped_count;
+};
+
+// process information that is returned by the query_process_list hypercall
+struct process_info {
+  uint64_t pid;
+  uint64_t eprocess;
+
+  // kernel CR3 (EPROCESS::DirectoryTableBase)
+  uint64_t cr3;
+
+  // EPROCESS::ImageFileName (null-terminated)
+  char image_file_name[16];
+};
+
+// kernel module information that is returned by the query_module_list hypercall
+struct module_info {
+  uint64_t base;
+  uint64_t size;
+
+  // KLDR_DATA_TABLE_ENTRY::BaseDllName (null-terminated and truncated to ASCII)
+  char name[64];
+};
+
+// logger statistics that are returned by the query_logger_stats hypercall
+struct logger_stats {
+  // the total messages sent (including messages that were dropped)
+  uint64_t total_msg_count;
+
+  // number of messages that are waiting to be flushed
+  uint32_t msg_count;
+
+  // the current size of the log ring
+  uint32_t msg_capacity;
+
+  uint32_t policy;
+  uint32_t mmr_stalled;
+
+  // number of messages that were lost, indexed by logger_channel
+  uint64_t dropped_msg_count[logger_channel_count];
+};
+
 namespace hc {
 
 // ping the hypervisor to make sure it is running
@@ -100,6 +174,58 @@ void remove_mmr(vcpu* cpu);
 // remove every installed MMR
 void remove_all_mmrs(vcpu* cpu);
 
+// start tracking which pages in a physical memory range are written to
+void enable_dirty_logging(vcpu* cpu);
+
+// stop tracking dirty pages
+void disable_dirty_logging(vcpu* cpu);
+
+// start a new checkpoint by marking every page in a range as clean
+void clear_dirty_pages(vcpu* cpu);
+
+// OR the dirty page bitmap for a physical memory range into a buffer
+void query_dirty_pages(vcpu* cpu);
+
+// deliver ept-violations for #VE MMRs to the guest as a #VE
+void enable_ve(vcpu* cpu);
+
+// stop delivering ept-violations to the guest as a #VE
+void disable_ve(vcpu* cpu);
+
+// get the number of accesses that were logged or dropped for an MMR
+void query_mmr_stats(vcpu* cpu);
+
+// get the kernel CR3 values of an array of processes
+void query_process_cr3_batch(vcpu* cpu);
+
+// get a snapshot of every process that is currently running
+void query_process_list(vcpu* cpu);
+
+// get a snapshot of every kernel module that is currently loaded
+void query_module_list(vcpu* cpu);
+
+// copy part of a loaded kernel module into a guest buffer and fix up its
+// PE headers so that it can be opened in a disassembler
+void dump_module(vcpu* cpu);
+
+// resize the hypervisor log and change what happens when it overflows
+void configure_logger(vcpu* cpu);
+
+// get the size of the hypervisor log and the number of messages that were lost
+void query_logger_stats(vcpu* cpu);
+
+// enable or disable logger channels at runtime
+void set_logger_channels(vcpu* cpu);
+
+// enable or disable CR3-load exiting on the current vcpu
+void configure_cr3_exiting(vcpu* cpu);
+
+// get the number of vm-exits for every exit reason on the current vcpu
+void query_exit_counts(vcpu* cpu);
+
+// change how vm-exit overhead is hidden from RDTSC on the current vcpu
+void set_timing_mode(vcpu* cpu);
+
 } // namespace hc
 
 } // namespace hv
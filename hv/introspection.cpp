@@ -1,9 +1,33 @@
 #include "introspection.h"
+#include "vcpu.h"
 #include "mm.h"
 #include "hv.h"
 
 namespace hv {
 
+// invalidate the values that are cached for the current vm-exit
+void begin_introspection_cache_exit(vcpu* const cpu) {
+  cpu->introspection.ethread_valid = false;
+}
+
+// invalidate every cached value, e.g. when the guest changes address spaces
+void invalidate_introspection_cache(vcpu* const cpu) {
+  auto& cache = cpu->introspection;
+
+  cache.ethread_valid         = false;
+  cache.key_cr3               = 0;
+  cache.key_ethread           = nullptr;
+  cache.eprocess_valid        = false;
+  cache.pid_valid             = false;
+  cache.kernel_cr3_valid      = false;
+  cache.image_file_name_valid = false;
+}
+
+// get the introspection cache of the current vcpu
+static vcpu_introspection_cache& current_cache() {
+  return reinterpret_cast<vcpu*>(_readfsbase_u64())->introspection;
+}
+
 // get the KPCR of the current guest (this pointer should stay constant per-vcpu)
 PKPCR current_guest_kpcr() {
   // GS base holds the KPCR when in ring-0
@@ -16,6 +40,11 @@ PKPCR current_guest_kpcr() {
 
 // get the ETHREAD of the current guest
 PETHREAD current_guest_ethread() {
+  auto& cache = current_cache();
+
+  if (cache.ethread_valid)
+    return cache.ethread;
+
   // KPCR
   auto const kpcr = current_guest_kpcr();
 
@@ -31,13 +60,41 @@ PETHREAD current_guest_ethread() {
   read_guest_virtual_memory(ghv.system_cr3,
     kprcb + ghv.kprcb_current_thread_offset, &current_thread, sizeof(current_thread));
 
+  cache.ethread       = current_thread;
+  cache.ethread_valid = true;
+
   return current_thread;
 }
 
+// get the cache for values that belong to the current guest thread
+static vcpu_introspection_cache& current_thread_cache() {
+  auto& cache = current_cache();
+
+  auto const ethread   = current_guest_ethread();
+  auto const guest_cr3 = vmx_vmread(VMCS_GUEST_CR3);
+
+  // a different thread or address space is running
+  if (cache.key_cr3 != guest_cr3 || cache.key_ethread != ethread) {
+    cache.key_cr3               = guest_cr3;
+    cache.key_ethread           = ethread;
+    cache.eprocess_valid        = false;
+    cache.pid_valid             = false;
+    cache.kernel_cr3_valid      = false;
+    cache.image_file_name_valid = false;
+  }
+
+  return cache;
+}
+
 // get the EPROCESS of the current guest
 PEPROCESS current_guest_eprocess() {
+  auto& cache = current_thread_cache();
+
+  if (cache.eprocess_valid)
+    return cache.eprocess;
+
   // ETHREAD (KTHREAD is first field as well)
-  auto const ethread = current_guest_ethread();
+  auto const ethread = cache.key_ethread;
 
   if (!ethread)
     return nullptr;
@@ -51,11 +108,19 @@ PEPROCESS current_guest_eprocess() {
   read_guest_virtual_memory(ghv.system_cr3,
     kapc_state + ghv.kapc_state_process_offset, &process, sizeof(process));
 
+  cache.eprocess       = process;
+  cache.eprocess_valid = true;
+
   return process;
 }
 
 // get the PID of the current guest
 uint64_t current_guest_pid() {
+  auto& cache = current_thread_cache();
+
+  if (cache.pid_valid)
+    return cache.pid;
+
   // EPROCESS
   auto const process = reinterpret_cast<uint8_t*>(current_guest_eprocess());
   if (!process)
@@ -66,11 +131,19 @@ uint64_t current_guest_pid() {
   read_guest_virtual_memory(ghv.system_cr3,
     process + ghv.eprocess_unique_process_id_offset, &pid, sizeof(pid));
 
+  cache.pid       = pid;
+  cache.pid_valid = true;
+
   return pid;
 }
 
 // get the kernel CR3 of the current guest
 cr3 current_guest_cr3() {
+  auto& cache = current_thread_cache();
+
+  if (cache.kernel_cr3_valid)
+    return cache.kernel_cr3;
+
   cr3 cr3;
   cr3.flags = 0;
 
@@ -83,11 +156,21 @@ cr3 current_guest_cr3() {
   read_guest_virtual_memory(ghv.system_cr3,
     process + ghv.kprocess_directory_table_base_offset, &cr3, sizeof(cr3));
 
+  cache.kernel_cr3       = cr3;
+  cache.kernel_cr3_valid = true;
+
   return cr3;
 }
 
 // get the image file name (up to 15 chars) of the current guest process
 bool current_guest_image_file_name(char (&name)[16]) {
+  auto& cache = current_thread_cache();
+
+  if (cache.image_file_name_valid) {
+    memcpy(name, cache.image_file_name, sizeof(name));
+    return true;
+  }
+
   memset(name, 0, sizeof(name));
 
   // EPROCESS
@@ -96,8 +179,127 @@ bool current_guest_image_file_name(char (&name)[16]) {
     return false;
 
   // EPROCESS::ImageFileName
-  return 15 == read_guest_virtual_memory(ghv.system_cr3,
-    process + ghv.eprocess_image_file_name, name, 15);
+  if (15 != read_guest_virtual_memory(ghv.system_cr3,
+      process + ghv.eprocess_image_file_name, name, 15))
+    return false;
+
+  memcpy(cache.image_file_name, name, sizeof(name));
+  cache.image_file_name_valid = true;
+
+  return true;
+}
+
+// get the slot in the process index that a PID maps to
+static process_index_entry& process_index_slot(uint64_t const pid) {
+  // PIDs are always a multiple of 4
+  return ghv.process_index.entries[(pid >> 2) & (process_index_size - 1)];
+}
+
+// insert a process into the process index, replacing whatever was there
+static void index_process(uint64_t const pid,
+    uint8_t* const eprocess, uint64_t const cr3) {
+  if (!pid)
+    return;
+
+  scoped_spin_lock lock(ghv.process_index.lock);
+
+  auto& entry    = process_index_slot(pid);
+  entry.pid      = pid;
+  entry.eprocess = eprocess;
+  entry.cr3      = cr3;
+}
+
+// add the current guest process to the process index
+void index_current_guest_process() {
+  auto const process = reinterpret_cast<uint8_t*>(current_guest_eprocess());
+  if (!process)
+    return;
+
+  auto const pid = current_guest_pid();
+  if (!pid)
+    return;
+
+  // this process is already indexed. the slot is checked without taking
+  // the lock, since this can be called on every processor at once. a torn
+  // read just means that the process gets indexed again.
+  auto const& entry = process_index_slot(pid);
+  if (entry.pid == pid && entry.eprocess == process)
+    return;
+
+  // EPROCESS::DirectoryTableBase
+  uint64_t cr3 = 0;
+  if (sizeof(cr3) != read_guest_virtual_memory(ghv.system_cr3,
+      process + ghv.kprocess_directory_table_base_offset, &cr3, sizeof(cr3)))
+    return;
+
+  index_process(pid, process, cr3);
+}
+
+// get the kernel CR3 of a process, or 0 if it doesn't exist
+uint64_t lookup_process_cr3(uint64_t const target_pid) {
+  // System process
+  if (target_pid == 4)
+    return ghv.system_cr3.flags;
+
+  process_index_entry cached;
+  {
+    scoped_spin_lock lock(ghv.process_index.lock);
+    cached = process_index_slot(target_pid);
+  }
+
+  // make sure that the EPROCESS still belongs to the same process, since
+  // processes can exit (and have their PIDs reused) at any time
+  if (cached.pid == target_pid) {
+    uint64_t pid = 0, cr3 = 0;
+
+    if (sizeof(pid) == read_guest_virtual_memory(ghv.system_cr3,
+          cached.eprocess + ghv.eprocess_unique_process_id_offset, &pid, sizeof(pid)) &&
+        sizeof(cr3) == read_guest_virtual_memory(ghv.system_cr3,
+          cached.eprocess + ghv.kprocess_directory_table_base_offset, &cr3, sizeof(cr3)) &&
+        pid == target_pid && cr3 == cached.cr3)
+      return cr3;
+  }
+
+  // ActiveProcessLinks is right after UniqueProcessId in memory
+  auto const apl_offset = ghv.eprocess_unique_process_id_offset + 8;
+  auto const head = ghv.ps_active_process_head;
+  auto curr_entry = head;
+
+  // iterate over every EPROCESS in the APL linked list, indexing
+  // every process that we come across along the way
+  while (true) {
+    // get the next entry in the linked list
+    if (sizeof(curr_entry) != read_guest_virtual_memory(ghv.system_cr3,
+        curr_entry + offsetof(LIST_ENTRY, Flink), &curr_entry, sizeof(curr_entry)))
+      break;
+
+    // the list head isn't part of an EPROCESS
+    if (curr_entry == head)
+      break;
+
+    // EPROCESS
+    auto const process = curr_entry - apl_offset;
+
+    // EPROCESS::UniqueProcessId
+    uint64_t pid = 0;
+    if (sizeof(pid) != read_guest_virtual_memory(ghv.system_cr3,
+        process + ghv.eprocess_unique_process_id_offset, &pid, sizeof(pid)))
+      break;
+
+    // EPROCESS::DirectoryTableBase
+    uint64_t cr3 = 0;
+    if (sizeof(cr3) != read_guest_virtual_memory(ghv.system_cr3,
+        process + ghv.kprocess_directory_table_base_offset, &cr3, sizeof(cr3)))
+      break;
+
+    index_process(pid, process, cr3);
+
+    // we found the target process
+    if (target_pid == pid)
+      return cr3;
+  }
+
+  return 0;
 }
 
 } // namespace hv
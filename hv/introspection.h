@@ -2,11 +2,59 @@
 
 #include "vmx.h"
 #include "mm.h"
+#include "spin-lock.h"
 
 #include <ntddk.h>
 
 namespace hv {
 
+struct vcpu;
+
+// per-vcpu cache of values that are expensive to read from the guest
+struct vcpu_introspection_cache {
+  // the current guest ETHREAD, which can't change in the middle of a vm-exit
+  PETHREAD ethread;
+  bool     ethread_valid;
+
+  // guest CR3 and ETHREAD that the following values belong to
+  uint64_t key_cr3;
+  PETHREAD key_ethread;
+
+  PEPROCESS eprocess;
+  bool      eprocess_valid;
+
+  uint64_t pid;
+  bool     pid_valid;
+
+  cr3  kernel_cr3;
+  bool kernel_cr3_valid;
+
+  char image_file_name[16];
+  bool image_file_name_valid;
+};
+
+// number of slots in the process index (must be a power of 2)
+inline constexpr size_t process_index_size = 1024;
+
+struct process_index_entry {
+  // a PID of 0 indicates that this slot is empty
+  uint64_t pid;
+  uint8_t* eprocess;
+  uint64_t cr3;
+};
+
+// direct-mapped PID -> (EPROCESS, CR3) index that is shared between vcpus
+struct process_index {
+  spin_lock lock;
+  process_index_entry entries[process_index_size];
+};
+
+// invalidate the values that are cached for the current vm-exit
+void begin_introspection_cache_exit(vcpu* cpu);
+
+// invalidate every cached value, e.g. when the guest changes address spaces
+void invalidate_introspection_cache(vcpu* cpu);
+
 // get the KPCR of the current guest (this pointer should stay constant per-vcpu)
 PKPCR current_guest_kpcr();
 
@@ -25,5 +73,11 @@ cr3 current_guest_cr3();
 // get the image file name (up to 15 chars) of the current guest process
 bool current_guest_image_file_name(char (&name)[16]);
 
+// add the current guest process to the process index
+void index_current_guest_process();
+
+// get the kernel CR3 of a process, or 0 if it doesn't exist
+uint64_t lookup_process_cr3(uint64_t pid);
+
 } // namespace hv
 
@@ -0,0 +1,293 @@
+#pragma once
+
+// the message formatting that is used by the logger. this file only depends
+// on the compiler so that it can be built and benchmarked outside of the
+// hypervisor (see tests/logger-bench.cpp).
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace hv {
+
+// the size of a formatted message, including the null-terminator
+inline constexpr uint32_t logger_max_msg_length = 128;
+
+// a log argument that was serialized by logger_write_typed()
+struct logger_arg {
+  union {
+    char const* str;
+    int64_t     i;
+    uint64_t    u;
+  };
+};
+
+// the layout of a format string with N specifiers, which is split into
+// N + 1 literal segments around the specifiers
+template <size_t N>
+struct logger_format_layout {
+  uint16_t literal_start[N + 1];
+  uint16_t literal_length[N + 1];
+  char     spec[N + 1];
+
+  // false if the specifiers don't match the number of arguments
+  bool valid;
+};
+
+// check whether a character is a supported format specifier
+constexpr bool logger_is_spec(char const c) {
+  return c == 's' || c == 'd' || c == 'i' || c == 'u' ||
+         c == 'x' || c == 'X' || c == 'p';
+}
+
+// parse a format string at compile-time
+template <size_t N>
+constexpr logger_format_layout<N> logger_parse_format(char const* const format) {
+  logger_format_layout<N> layout = {};
+
+  size_t   count = 0;
+  uint16_t start = 0;
+  uint16_t i     = 0;
+
+  for (; format[i]; ++i) {
+    if (format[i] != '%')
+      continue;
+
+    // too many specifiers, or an unsupported specifier
+    if (count >= N || !logger_is_spec(format[i + 1]))
+      return layout;
+
+    layout.literal_start[count]  = start;
+    layout.literal_length[count] = i - start;
+    layout.spec[count++]         = format[i + 1];
+
+    start = ++i + 1;
+  }
+
+  layout.literal_start[count]  = start;
+  layout.literal_length[count] = i - start;
+  layout.valid                 = (count == N);
+
+  return layout;
+}
+
+// the kind of value that an argument type can be formatted as
+template <typename T> struct logger_arg_traits {
+  static constexpr bool is_string  = false;
+  static constexpr bool is_pointer = false;
+  static constexpr bool is_integer = __is_enum(T);
+  static constexpr bool is_signed  = false;
+};
+
+template <typename T> struct logger_arg_traits<T*> {
+  static constexpr bool is_string  = false;
+  static constexpr bool is_pointer = true;
+  static constexpr bool is_integer = false;
+  static constexpr bool is_signed  = false;
+};
+
+template <> struct logger_arg_traits<char*> {
+  static constexpr bool is_string  = true;
+  static constexpr bool is_pointer = true;
+  static constexpr bool is_integer = false;
+  static constexpr bool is_signed  = false;
+};
+
+template <> struct logger_arg_traits<char const*>
+  : logger_arg_traits<char*> {};
+
+template <typename T, bool Signed> struct logger_integer_traits {
+  static constexpr bool is_string  = false;
+  static constexpr bool is_pointer = false;
+  static constexpr bool is_integer = true;
+  static constexpr bool is_signed  = Signed;
+};
+
+template <> struct logger_arg_traits<bool>               : logger_integer_traits<bool,               false> {};
+template <> struct logger_arg_traits<char>               : logger_integer_traits<char,               true>  {};
+template <> struct logger_arg_traits<signed char>        : logger_integer_traits<signed char,        true>  {};
+template <> struct logger_arg_traits<unsigned char>      : logger_integer_traits<unsigned char,      false> {};
+template <> struct logger_arg_traits<short>              : logger_integer_traits<short,              true>  {};
+template <> struct logger_arg_traits<unsigned short>     : logger_integer_traits<unsigned short,     false> {};
+template <> struct logger_arg_traits<int>                : logger_integer_traits<int,                true>  {};
+template <> struct logger_arg_traits<unsigned int>       : logger_integer_traits<unsigned int,       false> {};
+template <> struct logger_arg_traits<long>               : logger_integer_traits<long,               true>  {};
+template <> struct logger_arg_traits<unsigned long>      : logger_integer_traits<unsigned long,      false> {};
+template <> struct logger_arg_traits<long long>          : logger_integer_traits<long long,          true>  {};
+template <> struct logger_arg_traits<unsigned long long> : logger_integer_traits<unsigned long long, false> {};
+
+// check whether an argument type can be formatted with a specifier
+template <typename T>
+constexpr bool logger_arg_matches(char const spec) {
+  using traits = logger_arg_traits<T>;
+
+  switch (spec) {
+  // strings
+  case 's':
+    return traits::is_string;
+
+  // 32-bit integers
+  case 'd':
+  case 'i':
+  case 'u':
+  case 'x':
+  case 'X':
+    return traits::is_integer && sizeof(T) <= 4;
+
+  // pointers or integers of any size
+  case 'p':
+    return traits::is_pointer || traits::is_integer;
+  }
+
+  return false;
+}
+
+// check every argument type against its specifier
+template <typename... Args, size_t N>
+constexpr bool logger_args_match(char const (&specs)[N]) {
+  size_t i  = 0;
+  bool   ok = true;
+
+  ((ok = ok && logger_arg_matches<Args>(specs[i++])), ...);
+
+  return ok;
+}
+
+// serialize an argument
+template <typename T>
+logger_arg logger_make_arg(T const value) {
+  using traits = logger_arg_traits<T>;
+
+  logger_arg arg;
+
+  if constexpr (traits::is_string)
+    arg.str = value ? value : "(null)";
+  else if constexpr (traits::is_pointer)
+    arg.u = reinterpret_cast<uint64_t>(value);
+  else if constexpr (traits::is_signed)
+    arg.i = static_cast<int64_t>(value);
+  else
+    arg.u = static_cast<uint64_t>(value);
+
+  return arg;
+}
+
+/**
+ * C++ version 0.4 char* style "itoa":
+ * Written by Luks Chmela
+ * Released under GPLv3.
+ * https://stackoverflow.com/a/23840699
+ */
+template <typename T>
+char* lukas_itoa(T value, char* result, int base, bool upper = false) {
+  // check that the base if valid
+  if (base < 2 || base > 36) {
+    *result = '\0';
+    return result;
+  }
+
+  char* ptr = result, *ptr1 = result, tmp_char;
+  T tmp_value;
+
+  if (upper) {
+    do {
+      tmp_value = value;
+      value /= base;
+      *ptr++ = "ZYXWVUTSRQPONMLKJIHGFEDCBA9876543210123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        [35 + (tmp_value - value * base)];
+    } while ( value );
+  } else {
+    do {
+      tmp_value = value;
+      value /= base;
+      *ptr++ = "zyxwvutsrqponmlkjihgfedcba9876543210123456789abcdefghijklmnopqrstuvwxyz"
+        [35 + (tmp_value - value * base)];
+    } while ( value );
+  }
+
+  // Apply negative sign
+  if (tmp_value < 0)
+    *ptr++ = '-';
+
+  *ptr-- = '\0';
+  while(ptr1 < ptr) {
+    tmp_char = *ptr;
+    *ptr--= *ptr1;
+    *ptr1++ = tmp_char;
+  }
+
+  return result;
+}
+
+// copy the src string to the logger format buffer
+inline bool logger_format_copy_str(char* const buffer, char const* const src, uint32_t& idx) {
+  for (uint32_t i = 0; src[i]; ++i) {
+    buffer[idx++] = src[i];
+
+    // buffer end has been reached
+    if (idx >= logger_max_msg_length - 1) {
+      buffer[logger_max_msg_length - 1] = '\0';
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// copy length characters of the src string to the logger format buffer
+inline bool logger_format_copy_chars(char* const buffer,
+    char const* const src, uint32_t const length, uint32_t& idx) {
+  for (uint32_t i = 0; i < length; ++i) {
+    buffer[idx++] = src[i];
+
+    // buffer end has been reached
+    if (idx >= logger_max_msg_length - 1) {
+      buffer[logger_max_msg_length - 1] = '\0';
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// format a message whose format string was already parsed by
+// logger_parse_format() into a buffer of logger_max_msg_length characters
+inline void logger_format_args(char* const buffer, char const* const format,
+    uint16_t const* const literal_start, uint16_t const* const literal_length,
+    char const* const specs, logger_arg const* const args, size_t const arg_count) {
+  uint32_t idx = 0;
+
+  for (size_t i = 0; i <= arg_count; ++i) {
+    // the literal text before the i-th specifier (or the end of the string)
+    if (logger_format_copy_chars(buffer, format + literal_start[i], literal_length[i], idx))
+      break;
+
+    if (i == arg_count) {
+      buffer[idx] = '\0';
+      break;
+    }
+
+    char fmt_buffer[64];
+    char const* value = fmt_buffer;
+
+    switch (specs[i]) {
+    case 's': value = args[i].str; break;
+    case 'd':
+    case 'i': lukas_itoa(args[i].i, fmt_buffer, 10); break;
+    case 'u': lukas_itoa(static_cast<uint32_t>(args[i].u), fmt_buffer, 10); break;
+    case 'x': lukas_itoa(static_cast<uint32_t>(args[i].u), fmt_buffer, 16); break;
+    case 'X': lukas_itoa(static_cast<uint32_t>(args[i].u), fmt_buffer, 16, true); break;
+    case 'p': lukas_itoa(args[i].u, fmt_buffer, 16, true); break;
+    }
+
+    // hex values are always prefixed
+    if (specs[i] == 'x' || specs[i] == 'X' || specs[i] == 'p') {
+      if (logger_format_copy_str(buffer, "0x", idx))
+        break;
+    }
+
+    if (logger_format_copy_str(buffer, value, idx))
+      break;
+  }
+}
+
+} // namespace hv
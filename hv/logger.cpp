@@ -6,221 +6,163 @@
 namespace hv {
 
 // initialize the logger
-void logger_init() {
+bool logger_init() {
   auto& l = ghv.logger;
 
   memcpy(l.signature, "hvloggerhvlogger", 16);
 
   l.lock.initialize();
-  l.msg_start = 0;
-  l.msg_count = 0;
+  l.msg_start       = 0;
+  l.msg_count       = 0;
+  l.msg_capacity    = l.default_msg_capacity;
+  l.policy          = logger_overflow_drop_old;
+  l.mmr_stalled     = false;
   l.total_msg_count = 0;
 
-  logger_write("Logger initialized.");
-}
+  memset(l.dropped_msg_count, 0, sizeof(l.dropped_msg_count));
 
-// flush log messages to the provided buffer
-void logger_flush(uint32_t& count, logger_msg* const buffer) {
-  auto& l = ghv.logger;
+  logger_channel_mask = logger_default_channel_mask;
 
-  scoped_spin_lock lock(l.lock);
+  // always allocate the max size so that the ring can be resized in root-mode
+  l.msgs = static_cast<logger_msg*>(ExAllocatePoolWithTag(NonPagedPoolNx,
+    sizeof(logger_msg) * l.max_msg_capacity, 'fr0g'));
 
-  count = min(count, l.msg_count);
+  if (!l.msgs)
+    return false;
 
-  for (uint32_t i = 0; i < count; ++i) {
-    // copy the message to the buffer
-    buffer[i] = l.msgs[l.msg_start];
+  HV_LOG_INFO("Logger initialized.");
 
-    // increment msg_start
-    l.msg_start = (l.msg_start + 1) % l.max_msg_count;
-  }
+  return true;
+}
 
-  l.msg_count -= count;
+// free the memory that was allocated by logger_init()
+void logger_free() {
+  if (ghv.logger.msgs)
+    ExFreePoolWithTag(ghv.logger.msgs, 'fr0g');
+
+  ghv.logger.msgs = nullptr;
 }
 
-/**
- * C++ version 0.4 char* style "itoa":
- * Written by Luks Chmela
- * Released under GPLv3.
- * https://stackoverflow.com/a/23840699
- */
-template <typename T>
-static char* lukas_itoa(T value, char* result, int base, bool upper = false) {
-  // check that the base if valid
-  if (base < 2 || base > 36) {
-    *result = '\0';
-    return result;
+// reverse the order of the messages in [first, last)
+static void logger_reverse(logger_msg* const msgs, uint32_t first, uint32_t last) {
+  while (first + 1 < last) {
+    auto const tmp = msgs[first];
+    msgs[first++]  = msgs[--last];
+    msgs[last]     = tmp;
   }
+}
 
-  char* ptr = result, *ptr1 = result, tmp_char;
-  T tmp_value;
-
-  if (upper) {
-    do {
-      tmp_value = value;
-      value /= base;
-      *ptr++ = "ZYXWVUTSRQPONMLKJIHGFEDCBA9876543210123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-        [35 + (tmp_value - value * base)];
-    } while ( value );
-  } else {
-    do {
-      tmp_value = value;
-      value /= base;
-      *ptr++ = "zyxwvutsrqponmlkjihgfedcba9876543210123456789abcdefghijklmnopqrstuvwxyz"
-        [35 + (tmp_value - value * base)];
-    } while ( value );
-  }
+// resize the log ring and change the overflow policy
+void logger_configure(uint32_t capacity, logger_overflow_policy const policy) {
+  auto& l = ghv.logger;
 
-  // Apply negative sign
-  if (tmp_value < 0)
-    *ptr++ = '-';
+  capacity = max(1u, min(capacity, l.max_msg_capacity));
 
-  *ptr-- = '\0';
-  while(ptr1 < ptr) {
-    tmp_char = *ptr;
-    *ptr--= *ptr1;
-    *ptr1++ = tmp_char;
-  }
+  scoped_spin_lock lock(l.lock);
 
-  return result;
-}
+  l.policy      = policy;
+  l.mmr_stalled = false;
 
-// copy the src string to the logger format buffer
-static bool logger_format_copy_str(char* const buffer, char const* const src, uint32_t& idx) {
-  for (uint32_t i = 0; src[i]; ++i) {
-    buffer[idx++] = src[i];
+  if (capacity == l.msg_capacity)
+    return;
 
-    // buffer end has been reached
-    if (idx >= logger_msg::max_msg_length - 1) {
-      buffer[logger_msg::max_msg_length - 1] = '\0';
-      return true;
-    }
+  // rotate the ring so that the oldest message is at index 0
+  logger_reverse(l.msgs, 0, l.msg_start);
+  logger_reverse(l.msgs, l.msg_start, l.msg_capacity);
+  logger_reverse(l.msgs, 0, l.msg_capacity);
+
+  // only keep the newest messages if they don't all fit
+  if (l.msg_count > capacity) {
+    auto const dropped = l.msg_count - capacity;
+
+    for (uint32_t i = 0; i < dropped; ++i)
+      l.dropped_msg_count[l.msgs[i].channel % logger_channel_count] += 1;
+
+    memmove(l.msgs, l.msgs + dropped, capacity * sizeof(logger_msg));
+    l.msg_count = capacity;
   }
 
-  return false;
+  l.msg_start    = 0;
+  l.msg_capacity = capacity;
 }
 
-// format a string into a logger buffer, using
-// a limited subset of printf specifiers:
-//   %s, %i, %d, %u, %x, %X, %p
-static void logger_format(char* const buffer, char const* const format, va_list& args) {
-  uint32_t buffer_idx = 0;
-  uint32_t format_idx = 0;
-
-  // true if the last character was a '%'
-  bool specifying = false;
+// check whether MMR accesses shouldn't be traced right now
+bool logger_mmr_stalled() {
+  return ghv.logger.mmr_stalled;
+}
 
-  while (true) {
-    auto const c = format[format_idx++];
+// flush log messages to the provided buffer
+void logger_flush(uint32_t& count, logger_msg* const buffer) {
+  auto& l = ghv.logger;
 
-    // format end has been reached
-    if (c == '\0')
-      break;
+  scoped_spin_lock lock(l.lock);
 
-    if (c == '%') {
-      specifying = true;
-      continue;
-    }
+  count = min(count, l.msg_count);
 
-    // just copy the character directly
-    if (!specifying) {
-      buffer[buffer_idx++] = c;
+  for (uint32_t i = 0; i < count; ++i) {
+    // copy the message to the buffer
+    buffer[i] = l.msgs[l.msg_start];
 
-      // buffer end has been reached
-      if (buffer_idx >= logger_msg::max_msg_length - 1)
-        break;
+    // increment msg_start
+    l.msg_start = (l.msg_start + 1) % l.msg_capacity;
+  }
 
-      specifying = false;
-      continue;
-    }
+  l.msg_count -= count;
 
-    char fmt_buffer[128];
+  if (count > 0)
+    l.mmr_stalled = false;
+}
 
-    // format the string according to the specifier
-    switch (c) {
-    case 's': {
-      if (logger_format_copy_str(buffer, va_arg(args, char const*), buffer_idx))
-        return;
-      break;
-    }
-    case 'd':
-    case 'i': {
-      if (logger_format_copy_str(buffer,
-          lukas_itoa(va_arg(args, int), fmt_buffer, 10), buffer_idx))
-        return;
-      break;
-    }
-    case 'u': {
-      if (logger_format_copy_str(buffer,
-          lukas_itoa(va_arg(args, unsigned int), fmt_buffer, 10), buffer_idx))
-        return;
-      break;
-    }
-    case 'x': {
-      if (logger_format_copy_str(buffer, "0x", buffer_idx))
-        return;
-      if (logger_format_copy_str(buffer,
-          lukas_itoa(va_arg(args, unsigned int), fmt_buffer, 16), buffer_idx))
-        return;
-      break;
-    }
-    case 'X': {
-      if (logger_format_copy_str(buffer, "0x", buffer_idx))
-        return;
-      if (logger_format_copy_str(buffer,
-          lukas_itoa(va_arg(args, unsigned int), fmt_buffer, 16, true), buffer_idx))
-        return;
-      break;
-    }
-    case 'p': {
-      if (logger_format_copy_str(buffer, "0x", buffer_idx))
-        return;
-      if (logger_format_copy_str(buffer,
-          lukas_itoa(va_arg(args, uint64_t), fmt_buffer, 16, true), buffer_idx))
-        return;
-      break;
-    }
-    }
+// copy a formatted string into the log ring
+static void logger_commit(logger_channel const channel, char const* const str) {
+  auto& l = ghv.logger;
 
-    specifying = false;
-  }
+  scoped_spin_lock lock(l.lock);
 
-  buffer[buffer_idx] = '\0';
-}
+  // ids are still handed out to dropped messages so that gaps show up
+  l.total_msg_count += 1;
 
-// write a printf-style string to the logger using
-// a limited subset of printf specifiers:
-//   %s, %i, %d, %u, %x, %X, %p
-void logger_write(char const* const format, ...) {
-  char str[logger_msg::max_msg_length];
+  if (l.msg_count >= l.msg_capacity) {
+    auto drop_new = (l.policy == logger_overflow_drop_new);
 
-  // format the string
-  va_list args;
-  va_start(args, format);
-  logger_format(str, format, args);
-  va_end(args);
+    if (l.policy == logger_overflow_stall_mmr && channel == logger_channel_mmr_access) {
+      l.mmr_stalled = true;
+      drop_new = true;
+    }
 
-  auto& l = ghv.logger;
+    if (drop_new) {
+      l.dropped_msg_count[channel] += 1;
+      return;
+    }
 
-  scoped_spin_lock lock(l.lock);
+    // overwrite the oldest message
+    l.dropped_msg_count[l.msgs[l.msg_start].channel % logger_channel_count] += 1;
+    l.msg_start = (l.msg_start + 1) % l.msg_capacity;
+    l.msg_count -= 1;
+  }
 
-  auto& msg = l.msgs[(l.msg_start + l.msg_count) % l.max_msg_count];
-  
-  if (l.msg_count < l.max_msg_count)
-    l.msg_count += 1;
-  else
-    l.msg_start = (l.msg_start + 1) % l.max_msg_count;
+  auto& msg = l.msgs[(l.msg_start + l.msg_count) % l.msg_capacity];
+  l.msg_count += 1;
 
   // copy the string
   memset(msg.data, 0, msg.max_msg_length);
   for (size_t i = 0; (i < msg.max_msg_length - 1) && str[i]; ++i)
     msg.data[i] = str[i];
 
-  l.total_msg_count += 1;
-
   // set the metadata info about this message
-  msg.id  = l.total_msg_count;
-  msg.tsc = __rdtscp(&msg.aux);
+  msg.id      = l.total_msg_count;
+  msg.tsc     = __rdtscp(&msg.aux);
+  msg.channel = channel;
+}
+
+// write a message whose format string was already parsed by logger_write_typed()
+void logger_write_args(logger_channel const channel, char const* const format,
+    uint16_t const* const literal_start, uint16_t const* const literal_length,
+    char const* const specs, logger_arg const* const args, size_t const arg_count) {
+  char str[logger_msg::max_msg_length];
+  logger_format_args(str, format, literal_start, literal_length, specs, args, arg_count);
+
+  logger_commit(channel, str);
 }
 
 } // namespace hv
@@ -3,21 +3,67 @@
 #include <ia32.hpp>
 
 #include "spin-lock.h"
+#include "logger-format.h"
+
+// write to a logger channel. the arguments aren't evaluated (and the
+// string isn't formatted) unless the channel is enabled at runtime. the
+// format string is checked against the arguments at compile-time.
+#define HV_LOG_CHANNEL(channel, fmt, ...) do {        \
+    if (hv::logger_channel_enabled(channel))          \
+      hv::logger_write_typed(channel,                 \
+        []() constexpr { return fmt; }, __VA_ARGS__); \
+  } while (0)
 
 // generic logging levels, usually only ERRORs are useful
-#define HV_LOG_INFO(fmt, ...)    hv::logger_write(fmt, __VA_ARGS__)
-#define HV_LOG_ERROR(fmt, ...)   hv::logger_write(fmt, __VA_ARGS__)
-#define HV_LOG_VERBOSE(fmt, ...) hv::logger_write(fmt, __VA_ARGS__)
+#define HV_LOG_INFO(fmt, ...)    HV_LOG_CHANNEL(hv::logger_channel_info, fmt, __VA_ARGS__)
+#define HV_LOG_ERROR(fmt, ...)   HV_LOG_CHANNEL(hv::logger_channel_error, fmt, __VA_ARGS__)
+#define HV_LOG_VERBOSE(fmt, ...) HV_LOG_CHANNEL(hv::logger_channel_verbose, fmt, __VA_ARGS__)
 
 // specific logging
-#define HV_LOG_MMR_ACCESS(fmt, ...)     hv::logger_write(fmt, __VA_ARGS__)
-#define HV_LOG_INJECT_INT(fmt, ...)     //hv::logger_write(fmt, __VA_ARGS__)
-#define HV_LOG_HOST_EXCEPTION(fmt, ...) hv::logger_write(fmt, __VA_ARGS__)
+#define HV_LOG_MMR_ACCESS(fmt, ...)     HV_LOG_CHANNEL(hv::logger_channel_mmr_access, fmt, __VA_ARGS__)
+#define HV_LOG_INJECT_INT(fmt, ...)     HV_LOG_CHANNEL(hv::logger_channel_inject_int, fmt, __VA_ARGS__)
+#define HV_LOG_HOST_EXCEPTION(fmt, ...) HV_LOG_CHANNEL(hv::logger_channel_host_exception, fmt, __VA_ARGS__)
 
 namespace hv {
 
+// the category that a log message belongs to
+enum logger_channel : uint32_t {
+  logger_channel_info = 0,
+  logger_channel_error,
+  logger_channel_verbose,
+  logger_channel_mmr_access,
+  logger_channel_inject_int,
+  logger_channel_host_exception,
+  logger_channel_count
+};
+
+// channels that are enabled by default (interrupt injection is very noisy)
+inline constexpr uint32_t logger_default_channel_mask =
+  ((1u << logger_channel_count) - 1) & ~(1u << logger_channel_inject_int);
+
+// bitmask of the channels that are currently enabled (1 << logger_channel)
+inline volatile uint32_t logger_channel_mask = logger_default_channel_mask;
+
+// check whether a logger channel is enabled
+inline bool logger_channel_enabled(logger_channel const channel) {
+  return logger_channel_mask & (1u << channel);
+}
+
+// what to do when a message is written while the log is full
+enum logger_overflow_policy : uint32_t {
+  // overwrite the oldest message
+  logger_overflow_drop_old = 0,
+
+  // discard the new message
+  logger_overflow_drop_new,
+
+  // discard new MMR accesses (and stop tracing them) until the log is
+  // flushed, while still overwriting the oldest message for every other channel
+  logger_overflow_stall_mmr
+};
+
 struct logger_msg {
-  static constexpr uint32_t max_msg_length = 128;
+  static constexpr uint32_t max_msg_length = logger_max_msg_length;
 
   // ID of the current message
   uint64_t id;
@@ -28,12 +74,17 @@ struct logger_msg {
   // process ID of the VCPU that sent the message
   uint32_t aux;
 
+  // logger_channel that this message was written to
+  uint32_t channel;
+
   // null-terminated ascii string
   char data[max_msg_length];
 };
 
 struct logger {
-  static constexpr uint32_t max_msg_count = 512;
+  // the ring can be resized at runtime up to this many messages
+  static constexpr uint32_t max_msg_capacity     = 4096;
+  static constexpr uint32_t default_msg_capacity = 512;
 
   // signature to find logs in memory easier
   // "hvloggerhvlogger"
@@ -44,23 +95,64 @@ struct logger {
   uint32_t msg_start;
   uint32_t msg_count;
 
-  // the total messages sent
+  // the current size of the ring
+  uint32_t msg_capacity;
+
+  logger_overflow_policy policy;
+
+  // true if MMR accesses shouldn't be traced until the log is flushed
+  volatile bool mmr_stalled;
+
+  // the total messages sent (including messages that were dropped)
   uint64_t total_msg_count;
 
-  // an array of messages
-  logger_msg msgs[max_msg_count];
+  // number of messages that were lost, per channel
+  uint64_t dropped_msg_count[logger_channel_count];
+
+  // an array of max_msg_capacity messages
+  logger_msg* msgs;
 };
 
 // initialize the logger
-void logger_init();
+bool logger_init();
+
+// free the memory that was allocated by logger_init()
+void logger_free();
+
+// resize the log ring and change the overflow policy. the newest messages
+// are kept if the ring shrinks, and the rest are counted as dropped.
+void logger_configure(uint32_t capacity, logger_overflow_policy policy);
+
+// check whether MMR accesses shouldn't be traced right now
+bool logger_mmr_stalled();
 
 // flush log messages to the provided buffer
 void logger_flush(uint32_t& count, logger_msg* buffer);
 
-// write a printf-style string to the logger using
-// a limited subset of printf specifiers:
-//   %s, %i, %d, %u, %x, %X, %p
-void logger_write(char const* format, ...);
+// write a message whose format string was already parsed by logger_write_typed()
+void logger_write_args(logger_channel channel, char const* format,
+  uint16_t const* literal_start, uint16_t const* literal_length,
+  char const* specs, logger_arg const* args, size_t arg_count);
+
+// write a message to the logger. the format string (returned by format_fn,
+// which should be a constexpr lambda) is parsed and checked against the
+// argument types at compile-time.
+template <typename FormatFn, typename... Args>
+void logger_write_typed(logger_channel const channel,
+    FormatFn const format_fn, Args const... args) {
+  static constexpr char const* format = format_fn();
+  static constexpr auto layout = logger_parse_format<sizeof...(Args)>(format);
+
+  static_assert(layout.valid,
+    "Logger format string doesn't match the number of arguments.");
+  static_assert(logger_args_match<Args...>(layout.spec),
+    "Logger argument doesn't match its format specifier.");
+
+  logger_arg const serialized[sizeof...(Args) + 1] = { logger_make_arg(args)... };
+
+  logger_write_args(channel, format, layout.literal_start,
+    layout.literal_length, layout.spec, serialized, sizeof...(Args));
+}
 
 } // namespace hv
 
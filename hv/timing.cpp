@@ -2,13 +2,107 @@
 #include "vcpu.h"
 #include "vmx.h"
 #include "logger.h"
+#include "hv.h"
 
 #include <ntdef.h>
 
 namespace hv {
 
+// rebuild the PMC entries in the vm-exit MSR store and vm-entry MSR load
+// areas for the counters that are enabled in perf_global_ctrl
+void update_pmc_msr_areas(vcpu* const cpu, uint64_t const perf_global_ctrl) {
+  uint32_t count = 0;
+
+  auto const add_pmc = [&](uint32_t const store_msr, uint32_t const load_msr,
+      uint64_t const overhead, bool const os, bool const usr) {
+    cpu->pmcs[count].overhead = overhead;
+    cpu->pmcs[count].os       = os;
+    cpu->pmcs[count].usr      = usr;
+
+    // counters are frozen in root-mode (the host IA32_PERF_GLOBAL_CTRL is
+    // 0), so this is the same value that the guest left the counter at
+    cpu->msr_exit_store.pmcs[count].msr_idx  = store_msr;
+    cpu->msr_entry_load.pmcs[count].msr_idx  = load_msr;
+    cpu->msr_entry_load.pmcs[count].msr_data = __readmsr(store_msr);
+
+    ++count;
+  };
+
+  // 18.2.2
+  auto const fixed_ctr_ctrl = __readmsr(IA32_FIXED_CTR_CTRL);
+
+  for (uint32_t i = 0; i < cpu->cached.fixed_ctr_count; ++i) {
+    if (!(perf_global_ctrl & (1ull << (32 + i))))
+      continue;
+
+    // bit 0 enables counting in ring 0 and bit 1 enables counting in ring 3
+    auto const ctrl = (fixed_ctr_ctrl >> (i * 4)) & 0b11;
+
+    add_pmc(IA32_FIXED_CTR0 + i, IA32_FIXED_CTR0 + i,
+      cpu->vm_exit_fixed_ctr_overheads[i], ctrl & 0b01, ctrl & 0b10);
+  }
+
+  // without full-width writes, only the lower 32 bits can be restored
+  if (cpu->cached.pmc_full_width_writes) {
+    for (uint32_t i = 0; i < cpu->cached.gp_pmc_count; ++i) {
+      if (!(perf_global_ctrl & (1ull << i)))
+        continue;
+
+      // 18.2.1.1
+      auto const evtsel = __readmsr(IA32_PERFEVTSEL0 + i);
+      auto const event  = evtsel & 0xFF;
+      auto const umask  = (evtsel >> 8) & 0xFF;
+
+      // the overhead is only known for events that a fixed-function
+      // counter also counts, since those are the ones that are calibrated
+      uint64_t overhead = 0;
+      if (event == 0xC0 && umask == 0x00)
+        overhead = cpu->vm_exit_fixed_ctr_overheads[0];
+      else if (event == 0x3C && umask == 0x00)
+        overhead = cpu->vm_exit_fixed_ctr_overheads[1];
+
+      add_pmc(IA32_PMC0 + i, IA32_A_PMC0 + i, overhead,
+        evtsel & (1ull << 17), evtsel & (1ull << 16));
+    }
+  }
+
+  cpu->pmc_count            = count;
+  cpu->pmc_perf_global_ctrl = perf_global_ctrl;
+
+  // 3.24.7.2
+  vmx_vmwrite(VMCS_CTRL_VMEXIT_MSR_STORE_COUNT,
+    offsetof(decltype(vcpu::msr_exit_store), pmcs) / 16 + count);
+
+  // 3.24.8.2
+  vmx_vmwrite(VMCS_CTRL_VMENTRY_MSR_LOAD_COUNT,
+    offsetof(decltype(vcpu::msr_entry_load), pmcs) / 16 + count);
+}
+
+// restore the guest performance counters on vm-entry, minus the events
+// that were counted during the world-transition
+static void hide_pmc_overhead(vcpu* const cpu, uint64_t const perf_global_ctrl) {
+  // the guest enabled or disabled counters since the last vm-exit
+  if (perf_global_ctrl != cpu->pmc_perf_global_ctrl) {
+    update_pmc_msr_areas(cpu, perf_global_ctrl);
+    return;
+  }
+
+  auto const cpl = current_guest_cpl();
+
+  for (uint32_t i = 0; i < cpu->pmc_count; ++i) {
+    auto const& pmc = cpu->pmcs[i];
+    auto value = cpu->msr_exit_store.pmcs[i].msr_data;
+
+    if ((cpl == 0 && pmc.os) || (cpl == 3 && pmc.usr))
+      value -= min(value, pmc.overhead);
+
+    cpu->msr_entry_load.pmcs[i].msr_data = value;
+  }
+}
+
 // try to hide the vm-exit overhead from being detected through timings
-void hide_vm_exit_overhead(vcpu* const cpu) {
+void hide_vm_exit_overhead(vcpu* const cpu,
+    uint32_t const exit_reason, uint64_t const entry_tsc) {
   //
   // Guest APERF/MPERF values are stored/restored on vm-entry and vm-exit,
   // however, there appears to be a small, yet constant, overhead that occurs
@@ -30,21 +124,20 @@ void hide_vm_exit_overhead(vcpu* const cpu) {
   cpu->msr_entry_load.aperf.msr_data -= cpu->vm_exit_mperf_overhead;
   cpu->msr_entry_load.mperf.msr_data -= cpu->vm_exit_mperf_overhead;
 
-  // account for the constant overhead associated with loading/storing MSRs
-  if (perf_global_ctrl.en_fixed_ctrn & (1ull << 2)) {
-    auto const cpl = current_guest_cpl();
+  // same thing for every performance counter that the guest has enabled
+  hide_pmc_overhead(cpu, perf_global_ctrl.flags);
+
+  // the time that was actually spent in the exit handler, plus the
+  // calibrated world-transition overhead for this exit reason
+  auto const handler_tsc = __rdtsc() - entry_tsc;
+  cpu->last_exit_handler_tsc = handler_tsc;
 
-    ia32_fixed_ctr_ctrl_register fixed_ctr_ctrl;
-    fixed_ctr_ctrl.flags = __readmsr(IA32_FIXED_CTR_CTRL);
+  auto const tsc_overhead = handler_tsc + (exit_reason < vm_exit_reason_count ?
+    cpu->vm_exit_tsc_overheads[exit_reason] : cpu->vm_exit_tsc_overhead);
 
-    // this also needs to be done for many other PMCs, but whatever
-    if ((cpl == 0 && fixed_ctr_ctrl.en2_os) || (cpl == 3 && fixed_ctr_ctrl.en2_usr))
-      __writemsr(IA32_FIXED_CTR2, __readmsr(IA32_FIXED_CTR2) - cpu->vm_exit_ref_tsc_overhead);
-  }  
-  
   // this usually occurs for vm-exits that are unlikely to be reliably timed,
   // such as when an exception occurs or if the preemption timer fired
-  if (!cpu->hide_vm_exit_overhead || cpu->vm_exit_tsc_overhead > 10000) {
+  if (!cpu->hide_vm_exit_overhead || tsc_overhead > 10000) {
     // this is our chance to resync the TSC
     cpu->tsc_offset = 0;
 
@@ -59,171 +152,344 @@ void hide_vm_exit_overhead(vcpu* const cpu) {
     10000 >> cpu->cached.vmx_misc.preemption_timer_tsc_relationship);
 
   // use TSC offsetting to hide from timing attacks that use the TSC
-  cpu->tsc_offset -= cpu->vm_exit_tsc_overhead;
+  cpu->tsc_offset -= tsc_overhead;
 }
 
-// measure the overhead of a vm-exit (RDTSC)
-uint64_t measure_vm_exit_tsc_overhead() {
-  _disable();
+// change the timing mode of the current vcpu
+void set_timing_mode(vcpu* const cpu, timing_mode const mode, uint64_t const window_ticks) {
+  cpu->active_timing_mode = mode;
+  cpu->rdtsc_window_ticks = window_ticks ? window_ticks : default_rdtsc_window_ticks;
 
-  hypercall_input hv_input;
-  hv_input.code = hypercall_ping;
-  hv_input.key  = hypercall_key;
+  // the window never closes when RDTSC always exits
+  cpu->rdtsc_window_end = (mode == timing_mode_exit) ? ~0ull : 0;
 
-  uint64_t lowest_vm_exit_overhead = ~0ull;
-  uint64_t lowest_timing_overhead  = ~0ull;
+  set_rdtsc_exiting(cpu->rdtsc_window_end != 0);
+}
 
-  // perform the measurement 10 times and use the smallest time
-  for (int i = 0; i < 10; ++i) {
+// open or close the RDTSC exiting window, depending on the timing mode
+void update_rdtsc_window(vcpu* const cpu, uint32_t const exit_reason) {
+  if (cpu->active_timing_mode != timing_mode_windowed)
+    return;
+
+  auto const tsc = __rdtsc();
+
+  // RDTSC exits shouldn't keep the window open by themselves
+  if (cpu->hide_vm_exit_overhead &&
+      exit_reason != VMX_EXIT_REASON_EXECUTE_RDTSC &&
+      exit_reason != VMX_EXIT_REASON_EXECUTE_RDTSCP) {
+    if (!cpu->rdtsc_window_end)
+      set_rdtsc_exiting(true);
+
+    cpu->rdtsc_window_end = tsc + cpu->rdtsc_window_ticks;
+  }
+  else if (cpu->rdtsc_window_end && tsc >= cpu->rdtsc_window_end) {
+    cpu->rdtsc_window_end = 0;
+    set_rdtsc_exiting(false);
+    return;
+  }
+
+  if (!cpu->rdtsc_window_end)
+    return;
+
+  // make sure that we get a vm-exit in time to close the window
+  auto const ticks = cpu->rdtsc_window_end - tsc;
+  cpu->preemption_timer = min(cpu->preemption_timer, max(2,
+    ticks >> cpu->cached.vmx_misc.preemption_timer_tsc_relationship));
+}
+
+// sort an array of samples in ascending order
+static void sort_samples(uint64_t* const samples, size_t const count) {
+  // insertion sort, since there's no std::sort in here
+  for (size_t i = 1; i < count; ++i) {
+    auto const value = samples[i];
+
+    size_t j = i;
+    for (; j > 0 && samples[j - 1] > value; --j)
+      samples[j] = samples[j - 1];
+
+    samples[j] = value;
+  }
+}
+
+// get the mean of the samples between two percentiles (this sorts the samples)
+uint64_t trimmed_mean(uint64_t* const samples, size_t const count,
+    size_t const low_percentile, size_t const high_percentile) {
+  sort_samples(samples, count);
+
+  auto const first = count * low_percentile / 100;
+  auto const last  = max(first + 1, count * high_percentile / 100);
+
+  uint64_t sum = 0;
+  for (size_t i = first; i < last; ++i)
+    sum += samples[i];
+
+  return sum / (last - first);
+}
+
+// robust estimate of a set of overhead samples. this throws away outliers
+// (e.g. SMIs or cache misses) as well as unusually fast samples, while
+// still staying on the low side so that the guest TSC is never overcorrected
+static uint64_t estimate_overhead(uint64_t* const samples) {
+  return trimmed_mean(samples, overhead_sample_count, 5, 50);
+}
+
+// measure the overhead of a vm-exit with the specified counter. exit() is
+// called once to warm up before every sample, and exclude() is subtracted
+// from every sample after the vm-exit
+template <typename ReadCounter, typename CauseExit, typename Exclude>
+static uint64_t measure_overhead(ReadCounter const& read_counter,
+    CauseExit const& exit, Exclude const& exclude) {
+  uint64_t samples[overhead_sample_count];
+
+  // the overhead of reading the counter by itself
+  for (size_t i = 0; i < overhead_sample_count; ++i) {
     _mm_lfence();
-    auto start = __rdtsc();
+    auto const start = read_counter();
     _mm_lfence();
 
     _mm_lfence();
-    auto end = __rdtsc();
+    auto const end = read_counter();
     _mm_lfence();
 
-    auto const timing_overhead = (end - start);
+    samples[i] = end - start;
+  }
+
+  auto const timing_overhead = estimate_overhead(samples);
 
-    vmx_vmcall(hv_input);
+  for (size_t i = 0; i < overhead_sample_count; ++i) {
+    exit();
 
     _mm_lfence();
-    start = __rdtsc();
+    auto const start = read_counter();
     _mm_lfence();
 
-    vmx_vmcall(hv_input);
+    exit();
 
     _mm_lfence();
-    end = __rdtsc();
+    auto const end = read_counter();
     _mm_lfence();
 
-    auto const vm_exit_overhead = (end - start);
-
-    if (vm_exit_overhead < lowest_vm_exit_overhead)
-      lowest_vm_exit_overhead = vm_exit_overhead;
-    if (timing_overhead < lowest_timing_overhead)
-      lowest_timing_overhead = timing_overhead;
+    auto const excluded = exclude();
+    samples[i] = (end - start > excluded) ? (end - start - excluded) : 0;
   }
 
-  _enable();
-  return lowest_vm_exit_overhead - lowest_timing_overhead;
-}
+  auto const vm_exit_overhead = estimate_overhead(samples);
 
-// measure the overhead of a vm-exit (CPU_CLK_UNHALTED.REF_TSC)
-uint64_t measure_vm_exit_ref_tsc_overhead() {
-  _disable();
+  if (vm_exit_overhead < timing_overhead)
+    return 0;
 
+  return vm_exit_overhead - timing_overhead;
+}
+
+// cause a vm-exit with a VMCALL
+static void ping() {
   hypercall_input hv_input;
   hv_input.code = hypercall_ping;
   hv_input.key  = hypercall_key;
+  vmx_vmcall(hv_input);
+}
 
-  ia32_fixed_ctr_ctrl_register curr_fixed_ctr_ctrl;
-  curr_fixed_ctr_ctrl.flags = __readmsr(IA32_FIXED_CTR_CTRL);
+// nothing is excluded from measurements with counters other than the TSC
+static uint64_t exclude_nothing() {
+  return 0;
+}
 
-  ia32_perf_global_ctrl_register curr_perf_global_ctrl;
-  curr_perf_global_ctrl.flags = __readmsr(IA32_PERF_GLOBAL_CTRL);
+// measure the overhead of a world-transition (RDTSC)
+uint64_t measure_vm_exit_tsc_overhead(vcpu* const cpu) {
+  _disable();
 
-  // enable fixed counter #2
-  auto new_fixed_ctr_ctrl = curr_fixed_ctr_ctrl;
-  new_fixed_ctr_ctrl.en2_os      = 1;
-  new_fixed_ctr_ctrl.en2_usr     = 0;
-  new_fixed_ctr_ctrl.en2_pmi     = 0;
-  new_fixed_ctr_ctrl.any_thread2 = 0;
-  __writemsr(IA32_FIXED_CTR_CTRL, new_fixed_ctr_ctrl.flags);
-
-  // enable fixed counter #2
-  auto new_perf_global_ctrl = curr_perf_global_ctrl;
-  new_perf_global_ctrl.en_fixed_ctrn |= (1ull << 2);
-  __writemsr(IA32_PERF_GLOBAL_CTRL, new_perf_global_ctrl.flags);
-
-  uint64_t lowest_vm_exit_overhead = ~0ull;
-  uint64_t lowest_timing_overhead  = ~0ull;
-
-  // perform the measurement 10 times and use the smallest time
-  for (int i = 0; i < 10; ++i) {
-    _mm_lfence();
-    auto start = __readmsr(IA32_FIXED_CTR2);
-    _mm_lfence();
+  // VMCALL doesn't hide its overhead, so the time that is spent in the exit
+  // handler (which is measured on every vm-exit) has to be excluded here
+  auto const overhead = measure_overhead([] { return __rdtsc(); }, ping,
+    [cpu] { return cpu->last_exit_handler_tsc; });
 
-    _mm_lfence();
-    auto end = __readmsr(IA32_FIXED_CTR2);
-    _mm_lfence();
+  _enable();
+  return overhead;
+}
 
-    auto const timing_overhead = (end - start);
+// measure the overhead of a vm-exit (IA32_FIXED_CTRn)
+uint64_t measure_vm_exit_fixed_ctr_overhead(vcpu* const cpu, uint32_t const index) {
+  _disable();
 
-    vmx_vmcall(hv_input);
+  auto const curr_fixed_ctr_ctrl   = __readmsr(IA32_FIXED_CTR_CTRL);
+  auto const curr_perf_global_ctrl = __readmsr(IA32_PERF_GLOBAL_CTRL);
+  auto const counter_enable        = 1ull << (32 + index);
 
-    _mm_lfence();
-    start = __readmsr(IA32_FIXED_CTR2);
-    _mm_lfence();
+  // stop the counter before saving it, since the guest might be using it
+  // (e.g. a profiler) and shouldn't see any of our own events
+  __writemsr(IA32_PERF_GLOBAL_CTRL, curr_perf_global_ctrl & ~counter_enable);
+  auto const curr_fixed_ctr = __readmsr(IA32_FIXED_CTR0 + index);
 
-    vmx_vmcall(hv_input);
+  // count in ring 0 only, without PMIs or AnyThread
+  auto new_fixed_ctr_ctrl = curr_fixed_ctr_ctrl;
+  new_fixed_ctr_ctrl &= ~(0xFull << (index * 4));
+  new_fixed_ctr_ctrl |=  (0x1ull << (index * 4));
+  __writemsr(IA32_FIXED_CTR_CTRL, new_fixed_ctr_ctrl);
 
-    _mm_lfence();
-    end = __readmsr(IA32_FIXED_CTR2);
-    _mm_lfence();
+  // enable the fixed counter
+  __writemsr(IA32_PERF_GLOBAL_CTRL, curr_perf_global_ctrl | counter_enable);
 
-    auto const vm_exit_overhead = (end - start);
+  // make sure that the PMC list is rebuilt on the next vm-exit
+  cpu->pmc_perf_global_ctrl = ~0ull;
 
-    if (vm_exit_overhead < lowest_vm_exit_overhead)
-      lowest_vm_exit_overhead = vm_exit_overhead;
-    if (timing_overhead < lowest_timing_overhead)
-      lowest_timing_overhead = timing_overhead;
-  }
+  auto const overhead = measure_overhead(
+    [index] { return __readmsr(IA32_FIXED_CTR0 + index); }, ping, exclude_nothing);
 
-  // restore MSRs
-  __writemsr(IA32_PERF_GLOBAL_CTRL, curr_perf_global_ctrl.flags);
-  __writemsr(IA32_FIXED_CTR_CTRL, curr_fixed_ctr_ctrl.flags);
+  // restore MSRs (the counter is stopped while it is being restored)
+  __writemsr(IA32_PERF_GLOBAL_CTRL, curr_perf_global_ctrl & ~counter_enable);
+  __writemsr(IA32_FIXED_CTR0 + index, curr_fixed_ctr);
+  __writemsr(IA32_FIXED_CTR_CTRL, curr_fixed_ctr_ctrl);
+  __writemsr(IA32_PERF_GLOBAL_CTRL, curr_perf_global_ctrl);
+
+  cpu->pmc_perf_global_ctrl = ~0ull;
 
   _enable();
-  return lowest_vm_exit_overhead - lowest_timing_overhead;
+  return overhead;
 }
 
 // measure the overhead of a vm-exit (IA32_MPERF)
 uint64_t measure_vm_exit_mperf_overhead() {
   _disable();
 
-  hypercall_input hv_input;
-  hv_input.code = hypercall_ping;
-  hv_input.key  = hypercall_key;
+  auto const overhead = measure_overhead(
+    [] { return __readmsr(IA32_MPERF); }, ping, exclude_nothing);
 
-  uint64_t lowest_vm_exit_overhead = ~0ull;
-  uint64_t lowest_timing_overhead  = ~0ull;
+  _enable();
+  return overhead;
+}
 
-  // perform the measurement 10 times and use the smallest time
-  for (int i = 0; i < 10; ++i) {
-    _mm_lfence();
-    auto start = __readmsr(IA32_MPERF);
-    _mm_lfence();
+// measure the world-transition TSC overhead of the vm-exits that can be
+// caused on demand
+static void measure_vm_exit_tsc_overheads(uint64_t* const overheads) {
+  _disable();
 
-    _mm_lfence();
-    auto end = __readmsr(IA32_MPERF);
-    _mm_lfence();
+  auto const read_tsc = [] { return __rdtsc(); };
 
-    auto const timing_overhead = (end - start);
+  // unlike VMCALL, these exits hide their overhead. the calibrated overheads
+  // are zeroed while calibrating, so the TSC offset is already moved back by
+  // the exit handler time and nothing else should be excluded.
 
-    vmx_vmcall(hv_input);
+  overheads[VMX_EXIT_REASON_EXECUTE_CPUID] = measure_overhead(read_tsc, [] {
+    int regs[4];
+    __cpuid(regs, 0);
+  }, exclude_nothing);
 
-    _mm_lfence();
-    start = __readmsr(IA32_MPERF);
-    _mm_lfence();
+  // reads of IA32_FEATURE_CONTROL always cause a vm-exit
+  overheads[VMX_EXIT_REASON_EXECUTE_RDMSR] = measure_overhead(read_tsc, [] {
+    __readmsr(IA32_FEATURE_CONTROL);
+  }, exclude_nothing);
 
-    vmx_vmcall(hv_input);
+  if (__readcr4() & CR4_OS_XSAVE_FLAG) {
+    auto const xcr0 = _xgetbv(0);
+    overheads[VMX_EXIT_REASON_EXECUTE_XSETBV] = measure_overhead(read_tsc, [xcr0] {
+      _xsetbv(0, xcr0);
+    }, exclude_nothing);
+  }
 
-    _mm_lfence();
-    end = __readmsr(IA32_MPERF);
-    _mm_lfence();
+  _enable();
+}
+
+// measure the vm-exit overhead on the current processor
+void calibrate_vm_exit_overhead(vcpu* const cpu) {
+  // the old overhead shouldn't be hidden from our own measurements
+  cpu->vm_exit_tsc_overhead     = 0;
+  cpu->vm_exit_mperf_overhead   = 0;
+  memset(cpu->vm_exit_tsc_overheads, 0, sizeof(cpu->vm_exit_tsc_overheads));
+  memset(cpu->vm_exit_fixed_ctr_overheads, 0, sizeof(cpu->vm_exit_fixed_ctr_overheads));
+
+  // the PMC list still has the old overheads
+  cpu->pmc_perf_global_ctrl = ~0ull;
+
+  auto const tsc_overhead     = measure_vm_exit_tsc_overhead(cpu);
+  auto const mperf_overhead   = measure_vm_exit_mperf_overhead();
+
+  uint64_t fixed_ctr_overheads[max_fixed_ctr_count] = {};
+  for (uint32_t i = 0; i < cpu->cached.fixed_ctr_count; ++i)
+    fixed_ctr_overheads[i] = measure_vm_exit_fixed_ctr_overhead(cpu, i);
+
+  // exit reasons that can't be caused on demand use the VMCALL overhead
+  uint64_t tsc_overheads[vm_exit_reason_count];
+  for (auto& overhead : tsc_overheads)
+    overhead = tsc_overhead;
+
+  measure_vm_exit_tsc_overheads(tsc_overheads);
+
+  cpu->vm_exit_tsc_overhead     = tsc_overhead;
+  cpu->vm_exit_mperf_overhead   = mperf_overhead;
+  memcpy(cpu->vm_exit_tsc_overheads, tsc_overheads, sizeof(tsc_overheads));
+  memcpy(cpu->vm_exit_fixed_ctr_overheads, fixed_ctr_overheads, sizeof(fixed_ctr_overheads));
+
+  // pick up the new PMC overheads on the next vm-exit
+  cpu->pmc_perf_global_ctrl = ~0ull;
+
+  auto& state = cpu->calibration;
+  state.tsc   = __rdtsc();
+  state.aperf = __readmsr(IA32_APERF);
+  state.mperf = __readmsr(IA32_MPERF);
+
+  // the next check picks up the new effective frequency
+  state.freq_ratio   = 0;
+  state.freq_changes = 0;
+}
 
-    auto const vm_exit_overhead = (end - start);
+// check whether the vm-exit overhead on the current processor should be
+// recalibrated, because the effective frequency changed or because the
+// last calibration is too old
+bool vm_exit_overhead_stale(vcpu* const cpu) {
+  auto& state = cpu->calibration;
 
-    if (vm_exit_overhead < lowest_vm_exit_overhead)
-      lowest_vm_exit_overhead = vm_exit_overhead;
-    if (timing_overhead < lowest_timing_overhead)
-      lowest_timing_overhead = timing_overhead;
+  auto const tsc   = __rdtsc();
+  auto const aperf = __readmsr(IA32_APERF);
+  auto const mperf = __readmsr(IA32_MPERF);
+
+  // the effective frequency since the last check (relative to the TSC)
+  uint64_t freq_ratio = state.freq_ratio;
+  if (mperf > state.mperf)
+    freq_ratio = (aperf - state.aperf) * 1000 / (mperf - state.mperf);
+
+  state.aperf = aperf;
+  state.mperf = mperf;
+
+  auto const elapsed = tsc - state.tsc;
+
+  if (elapsed > overhead_recalibration_interval * ghv.tsc_frequency)
+    return true;
+
+  // the first sample after a calibration
+  if (state.freq_ratio == 0) {
+    state.freq_ratio = freq_ratio;
+    return false;
   }
 
-  _enable();
-  return lowest_vm_exit_overhead - lowest_timing_overhead;
+  auto const delta = freq_ratio > state.freq_ratio ?
+    freq_ratio - state.freq_ratio : state.freq_ratio - freq_ratio;
+
+  // only a change that sticks around is worth recalibrating for
+  if (delta * 100 > state.freq_ratio * overhead_recalibration_freq_delta)
+    state.freq_changes += 1;
+  else
+    state.freq_changes = 0;
+
+  if (state.freq_changes < overhead_recalibration_freq_checks)
+    return false;
+
+  return elapsed > overhead_recalibration_min_interval * ghv.tsc_frequency;
+}
+
+// measure the number of TSC ticks per second
+uint64_t measure_tsc_frequency() {
+  LARGE_INTEGER qpc_frequency;
+
+  auto const start_qpc = KeQueryPerformanceCounter(&qpc_frequency).QuadPart;
+  auto const start_tsc = __rdtsc();
+
+  // 10ms is plenty accurate for rate limiting purposes
+  KeStallExecutionProcessor(10'000);
+
+  auto const end_qpc = KeQueryPerformanceCounter(nullptr).QuadPart;
+  auto const end_tsc = __rdtsc();
+
+  return (end_tsc - start_tsc) * qpc_frequency.QuadPart / (end_qpc - start_qpc);
 }
 
 } // namespace hv
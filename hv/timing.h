@@ -6,17 +6,101 @@ namespace hv {
 
 struct vcpu;
 
-// try to hide the vm-exit overhead from being detected through timings
-void hide_vm_exit_overhead(vcpu* cpu);
+// how the guest TSC is kept consistent with the hidden vm-exit overhead
+enum timing_mode : uint32_t {
+  // RDTSC never causes a vm-exit, and only the TSC offset is used
+  timing_mode_offset,
 
-// measure the overhead of a vm-exit (RDTSC)
-uint64_t measure_vm_exit_tsc_overhead();
+  // RDTSC causes a vm-exit for a short window after every vm-exit whose
+  // overhead was hidden (e.g. the CPUID in RDTSC; CPUID; RDTSC)
+  timing_mode_windowed,
 
-// measure the overhead of a vm-exit (CPU_CLK_UNHALTED.REF_TSC)
-uint64_t measure_vm_exit_ref_tsc_overhead();
+  // RDTSC always causes a vm-exit
+  timing_mode_exit
+};
+
+// default length of an RDTSC exiting window (in TSC ticks)
+inline constexpr uint64_t default_rdtsc_window_ticks = 50'000;
+
+// number of samples that are taken for every overhead measurement
+inline constexpr size_t overhead_sample_count = 256;
+
+// how often to check whether the overhead needs to be recalibrated (in ms)
+inline constexpr uint64_t overhead_recalibration_poll_ms = 1000;
+
+// how late a check can be so that it can be coalesced with other timers (in ms)
+inline constexpr uint64_t overhead_recalibration_tolerable_delay_ms = 500;
+
+// recalibrate when the effective frequency changes by more than this (in %)
+inline constexpr uint64_t overhead_recalibration_freq_delta = 10;
+
+// the frequency change has to be seen on this many consecutive checks, so
+// that short turbo or load spikes don't cause a recalibration
+inline constexpr uint32_t overhead_recalibration_freq_checks = 3;
+
+// never recalibrate more often than this (in seconds)
+inline constexpr uint64_t overhead_recalibration_min_interval = 10;
+
+// recalibrate at least this often (in seconds). together with the limits
+// above, a processor recalibrates once a minute when its frequency is
+// stable and at most every 10 seconds when it keeps changing.
+inline constexpr uint64_t overhead_recalibration_interval = 60;
+
+// used to decide when the vm-exit overhead should be recalibrated
+struct vcpu_overhead_calibration {
+  // TSC when the overhead was last calibrated
+  uint64_t tsc;
+
+  // APERF and MPERF when the effective frequency was last sampled
+  uint64_t aperf;
+  uint64_t mperf;
+
+  // APERF/MPERF ratio (in 1/1000ths) right after the last calibration
+  uint64_t freq_ratio;
+
+  // number of consecutive checks that saw a large frequency change
+  uint32_t freq_changes;
+};
+
+// rebuild the PMC entries in the vm-exit MSR store and vm-entry MSR load
+// areas for the counters that are enabled in perf_global_ctrl
+void update_pmc_msr_areas(vcpu* cpu, uint64_t perf_global_ctrl);
+
+// try to hide the vm-exit overhead from being detected through timings.
+// entry_tsc is the TSC at the start of the exit handler
+void hide_vm_exit_overhead(vcpu* cpu, uint32_t exit_reason, uint64_t entry_tsc);
+
+// change the timing mode of the current vcpu
+void set_timing_mode(vcpu* cpu, timing_mode mode, uint64_t window_ticks);
+
+// open or close the RDTSC exiting window, depending on the timing mode
+void update_rdtsc_window(vcpu* cpu, uint32_t exit_reason);
+
+// get the mean of the samples between two percentiles (this sorts the samples)
+uint64_t trimmed_mean(uint64_t* samples, size_t count,
+  size_t low_percentile, size_t high_percentile);
+
+// measure the overhead of a world-transition (RDTSC), which doesn't
+// include the time that is spent in the exit handler
+uint64_t measure_vm_exit_tsc_overhead(vcpu* cpu);
+
+// measure the overhead of a vm-exit (IA32_FIXED_CTRn). this must be called
+// from the guest
+uint64_t measure_vm_exit_fixed_ctr_overhead(vcpu* cpu, uint32_t index);
 
 // measure the overhead of a vm-exit (IA32_MPERF)
 uint64_t measure_vm_exit_mperf_overhead();
 
+// measure the vm-exit overhead (for every exit reason that can be caused
+// on demand) on the current processor. this must be called from the guest
+void calibrate_vm_exit_overhead(vcpu* cpu);
+
+// check whether the vm-exit overhead on the current processor should be
+// recalibrated. this must be called from the guest
+bool vm_exit_overhead_stale(vcpu* cpu);
+
+// measure the number of TSC ticks per second
+uint64_t measure_tsc_frequency();
+
 } // namespace hv
 
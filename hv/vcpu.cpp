@@ -46,6 +46,33 @@ static void cache_cpu_data(vcpu_cached_data& cached) {
 
   cached.feature_control.flags = __readmsr(IA32_FEATURE_CONTROL);
   cached.vmx_misc.flags        = __readmsr(IA32_VMX_MISC);
+  cached.ept_vpid_cap.flags    = __readmsr(IA32_VMX_EPT_VPID_CAP);
+
+  // the upper 32 bits specify which secondary controls can be set to 1
+  cached.procbased_ctls2_allowed1.flags = __readmsr(IA32_VMX_PROCBASED_CTLS2) >> 32;
+
+  // this MSR only exists if VM functions are supported
+  cached.vmfunc.flags = 0;
+  if (cached.procbased_ctls2_allowed1.enable_vm_functions)
+    cached.vmfunc.flags = __readmsr(IA32_VMX_VMFUNC);
+
+  // 18.2.1
+  uint32_t cpuid_0a[4];
+  __cpuid(reinterpret_cast<int*>(cpuid_0a), 0x0A);
+
+  auto const pmu_version = cpuid_0a[0] & 0xFF;
+
+  cached.gp_pmc_count    = min(max_gp_pmc_count, (cpuid_0a[0] >> 8) & 0xFF);
+  cached.fixed_ctr_count = 0;
+
+  // fixed-function counters are only enumerated in version 2 and up
+  if (pmu_version >= 2)
+    cached.fixed_ctr_count = min(max_fixed_ctr_count, cpuid_0a[3] & 0x1F);
+
+  // IA32_PERF_CAPABILITIES is only supported if CPUID.01H:ECX.PDCM is set
+  cached.pmc_full_width_writes = false;
+  if (cached.cpuid_01.cpuid_feature_information_ecx.flags & (1 << 15))
+    cached.pmc_full_width_writes = __readmsr(IA32_PERF_CAPABILITIES) & (1 << 13);
 
   // create a fake guest FEATURE_CONTROL MSR that has VMX and SMX disabled
   cached.guest_feature_control                               = cached.feature_control;
@@ -166,12 +193,23 @@ static void enable_mtrr_exiting(vcpu* const cpu) {
   }
 }
 
+// enable vm-exits for writes to the MSRs that select what the performance
+// counters count, since the PMC list needs to be rebuilt when they change
+static void enable_pmc_ctrl_exiting(vcpu* const cpu) {
+  if (cpu->cached.fixed_ctr_count > 0)
+    enable_exit_for_msr_write(cpu->msr_bitmap, IA32_FIXED_CTR_CTRL, true);
+
+  for (uint32_t i = 0; i < cpu->cached.gp_pmc_count; ++i)
+    enable_exit_for_msr_write(cpu->msr_bitmap, IA32_PERFEVTSEL0 + i, true);
+}
+
 // initialize external structures that are not included in the VMCS
 static void prepare_external_structures(vcpu* const cpu) {
   memset(&cpu->msr_bitmap, 0, sizeof(cpu->msr_bitmap));
   enable_exit_for_msr_read(cpu->msr_bitmap, IA32_FEATURE_CONTROL, true);
 
   enable_mtrr_exiting(cpu);
+  enable_pmc_ctrl_exiting(cpu);
 
   // we don't care about anything that's in the TSS
   memset(&cpu->host_tss, 0, sizeof(cpu->host_tss));
@@ -202,6 +240,7 @@ static void dispatch_vm_exit(vcpu* const cpu, vmx_vmexit_reason const reason) {
   case VMX_EXIT_REASON_EXECUTE_RDTSCP:               emulate_rdtscp(cpu);              break;
   case VMX_EXIT_REASON_MONITOR_TRAP_FLAG:            handle_monitor_trap_flag(cpu);    break;
   case VMX_EXIT_REASON_EPT_MISCONFIGURATION:         handle_ept_misconfiguration(cpu); break;
+  case VMX_EXIT_REASON_PAGE_MODIFICATION_LOG_FULL:   handle_pml_full(cpu);             break;
   // VMX instructions (except for VMXON and VMCALL)
   case VMX_EXIT_REASON_EXECUTE_INVEPT:
   case VMX_EXIT_REASON_EXECUTE_INVVPID:
@@ -224,15 +263,51 @@ static void dispatch_vm_exit(vcpu* const cpu, vmx_vmexit_reason const reason) {
   }
 }
 
+// index the current guest process the first time that this vcpu sees its
+// CR3. with KPTI, the guest CR3 changes on nearly every vm-exit, but it
+// keeps alternating between the same few values.
+static void index_guest_cr3(vcpu* const cpu, uint64_t const guest_cr3) {
+  auto const pfn     = guest_cr3 >> 12;
+  auto const process = current_guest_eprocess();
+  auto& slot = cpu->indexed_guest_cr3s[pfn & (indexed_guest_cr3_count - 1)];
+
+  // a new process might be using a directory table that was freed
+  if (slot.pfn == pfn && slot.process == process)
+    return;
+
+  slot.pfn     = pfn;
+  slot.process = process;
+  index_current_guest_process();
+}
+
 // called for every vm-exit
 bool handle_vm_exit(guest_context* const ctx) {
+  // used for measuring how long this vm-exit took to handle
+  auto const entry_tsc = __rdtsc();
+
   // get the current vcpu
   auto const cpu = reinterpret_cast<vcpu*>(_readfsbase_u64());
   cpu->ctx = ctx;
 
+  // the current guest thread might have changed since the last vm-exit
+  begin_introspection_cache_exit(cpu);
+
   vmx_vmexit_reason reason;
   reason.flags = static_cast<uint32_t>(vmx_vmread(VMCS_EXIT_REASON));
 
+  if (reason.basic_exit_reason < vm_exit_reason_count)
+    ++cpu->exit_reason_counts[reason.basic_exit_reason];
+
+  // without CR3-load exiting, new processes are only noticed when they
+  // happen to be running during a vm-exit
+  if (!cpu->cr3_load_exiting) {
+    auto const guest_cr3 = vmx_vmread(VMCS_GUEST_CR3);
+    if (guest_cr3 != cpu->last_seen_guest_cr3) {
+      cpu->last_seen_guest_cr3 = guest_cr3;
+      index_guest_cr3(cpu, guest_cr3);
+    }
+  }
+
   // dont hide tsc overhead by default
   cpu->hide_vm_exit_overhead = false;
   cpu->stop_virtualization   = false;
@@ -243,11 +318,13 @@ bool handle_vm_exit(guest_context* const ctx) {
   interrupt_info.flags = static_cast<uint32_t>(
     vmx_vmread(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD));
 
-  if (interrupt_info.valid) {
+  // don't bother reading the process name if nobody is listening
+  if (interrupt_info.valid && logger_channel_enabled(logger_channel_inject_int)) {
     char name[16] = {};
     current_guest_image_file_name(name);
-    HV_LOG_INJECT_INT("Injecting interrupt into guest (%s). BasicExitReason=%i, Vector=%i, Error=%i.",
-      name, reason.basic_exit_reason, interrupt_info.vector, vmx_vmread(VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE));
+    HV_LOG_INJECT_INT("Injecting interrupt into guest (%s). BasicExitReason=%u, Vector=%u, Error=%u.",
+      name, reason.basic_exit_reason, interrupt_info.vector,
+      static_cast<uint32_t>(vmx_vmread(VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE)));
   }
 
   // restore guest state. the assembly code is responsible for restoring
@@ -308,7 +385,19 @@ bool handle_vm_exit(guest_context* const ctx) {
     return true;
   }
 
-  hide_vm_exit_overhead(cpu);
+  hide_vm_exit_overhead(cpu, reason.basic_exit_reason, entry_tsc);
+  update_rdtsc_window(cpu, reason.basic_exit_reason);
+
+  // re-enable monitoring on any suspended MMR pages that have expired and
+  // make sure that we get a vm-exit in time to resume the remaining ones
+  auto const resume_tsc = resume_suspended_mmr_pages(cpu->ept);
+  if (resume_tsc != ~0ull) {
+    auto const tsc   = __rdtsc();
+    auto const ticks = (resume_tsc > tsc) ? (resume_tsc - tsc) : 0;
+
+    cpu->preemption_timer = min(cpu->preemption_timer, max(2,
+      ticks >> cpu->cached.vmx_misc.preemption_timer_tsc_relationship));
+  }
 
   // sync the vmcs state with the vcpu state
   vmx_vmwrite(VMCS_CTRL_TSC_OFFSET,                  cpu->tsc_offset);
@@ -416,7 +505,15 @@ bool virtualize_cpu(vcpu* const cpu) {
   cpu->preemption_timer          = 0;
   cpu->vm_exit_tsc_overhead      = 0;
   cpu->vm_exit_mperf_overhead    = 0;
-  cpu->vm_exit_ref_tsc_overhead  = 0;
+  cpu->cr3_load_exiting          = false;
+  cpu->cr3_mtf_pending           = false;
+  cpu->last_seen_guest_cr3       = 0;
+  cpu->active_timing_mode        = timing_mode_offset;
+  cpu->rdtsc_window_ticks        = default_rdtsc_window_ticks;
+  cpu->rdtsc_window_end          = 0;
+
+  memset(cpu->exit_reason_counts, 0, sizeof(cpu->exit_reason_counts));
+  memset(cpu->indexed_guest_cr3s, 0, sizeof(cpu->indexed_guest_cr3s));
 
   DbgPrint("Launching VM on VCPU#%i...\n", KeGetCurrentProcessorIndex() + 1);
 
@@ -437,16 +534,18 @@ bool virtualize_cpu(vcpu* const cpu) {
   if (vmx_vmcall(input) == hypervisor_signature)
     DbgPrint("[hv] Successfully pinged the hypervisor.\n");
 
-  cpu->vm_exit_tsc_overhead      = measure_vm_exit_tsc_overhead();
-  cpu->vm_exit_mperf_overhead    = measure_vm_exit_mperf_overhead();
-  cpu->vm_exit_ref_tsc_overhead  = measure_vm_exit_ref_tsc_overhead();
+  calibrate_vm_exit_overhead(cpu);
 
   DbgPrint("[hv] Measured VM-exit overhead (TSC = %zi).\n",
     cpu->vm_exit_tsc_overhead);
   DbgPrint("[hv] Measured VM-exit overhead (MPERF = %zi).\n",
     cpu->vm_exit_mperf_overhead);
+  DbgPrint("[hv] Measured VM-exit overhead (INST_RETIRED.ANY = %zi).\n",
+    cpu->vm_exit_fixed_ctr_overheads[0]);
+  DbgPrint("[hv] Measured VM-exit overhead (CPU_CLK_UNHALTED.THREAD = %zi).\n",
+    cpu->vm_exit_fixed_ctr_overheads[1]);
   DbgPrint("[hv] Measured VM-exit overhead (CPU_CLK_UNHALTED.REF_TSC = %zi).\n",
-    cpu->vm_exit_ref_tsc_overhead);
+    cpu->vm_exit_fixed_ctr_overheads[2]);
 
   return true;
 }
@@ -7,6 +7,7 @@
 #include "ept.h"
 #include "vmx.h"
 #include "timing.h"
+#include "introspection.h"
 
 namespace hv {
 
@@ -16,6 +17,24 @@ inline constexpr size_t host_stack_size = 0x6000;
 // guest virtual-processor identifier
 inline constexpr uint16_t guest_vpid = 1;
 
+// number of basic exit reasons that vm-exits are counted for (Appendix C)
+inline constexpr size_t vm_exit_reason_count = 128;
+
+// number of guest CR3 values that every vcpu remembers indexing (power of 2)
+inline constexpr size_t indexed_guest_cr3_count = 64;
+
+// a guest CR3 that a vcpu indexed the process for. directory table pages
+// get reused by new processes, so the EPROCESS is part of the key.
+struct vcpu_indexed_guest_cr3 {
+  uint64_t  pfn;
+  PEPROCESS process;
+};
+
+// max number of performance counters that are virtualized
+inline constexpr uint32_t max_fixed_ctr_count = 3;
+inline constexpr uint32_t max_gp_pmc_count    = 8;
+inline constexpr uint32_t max_pmc_count       = max_fixed_ctr_count + max_gp_pmc_count;
+
 struct vcpu_cached_data {
   // maximum number of bits in a physical address (MAXPHYSADDR)
   uint64_t max_phys_addr;
@@ -36,34 +55,77 @@ struct vcpu_cached_data {
   // IA32_VMX_MISC
   ia32_vmx_misc_register vmx_misc;
 
+  // IA32_VMX_EPT_VPID_CAP
+  ia32_vmx_ept_vpid_cap_register ept_vpid_cap;
+
+  // secondary processor-based controls that are allowed to be 1
+  ia32_vmx_procbased_ctls2_register procbased_ctls2_allowed1;
+
+  // IA32_VMX_VMFUNC
+  ia32_vmx_vmfunc_register vmfunc;
+
   // CPUID 0x01
   cpuid_eax_01 cpuid_01;
+
+  // number of performance counters that are virtualized
+  uint32_t fixed_ctr_count;
+  uint32_t gp_pmc_count;
+
+  // whether general-purpose counters can be written with IA32_A_PMCx
+  bool pmc_full_width_writes;
+};
+
+// a performance counter in the vm-exit MSR store and vm-entry MSR load areas
+struct vcpu_pmc {
+  // the number of events that a world-transition adds to this counter
+  uint64_t overhead;
+
+  // whether the counter counts events in ring 0 and ring 3
+  bool os;
+  bool usr;
 };
 
 struct vcpu {
-  // 4 KiB vmxon region
-  alignas(0x1000) vmxon vmxon;
+  // the fields up until cached are accessed on (nearly) every vm-exit, so
+  // they are kept together at the start of the vcpu instead of after the
+  // hundreds of KiB of page-aligned tables
 
-  // 4 KiB vmcs region
-  alignas(0x1000) vmcs vmcs;
+  // pointer to the current guest context, set in exit-handler
+  alignas(64) guest_context* ctx;
 
-  // 4 KiB msr bitmap
-  alignas(0x1000) vmx_msr_bitmap msr_bitmap;
+  // current TSC offset
+  uint64_t tsc_offset;
 
-  // host stack used for handling vm-exits
-  alignas(0x1000) uint8_t host_stack[host_stack_size];
+  // current preemption timer
+  uint64_t preemption_timer;
 
-  // host interrupt descriptor table
-  alignas(0x1000) segment_descriptor_interrupt_gate_64 host_idt[host_idt_descriptor_count];
+  // the overhead caused by world-transitions
+  uint64_t vm_exit_tsc_overhead;
+  uint64_t vm_exit_mperf_overhead;
 
-  // host global descriptor table
-  alignas(0x1000) segment_descriptor_32 host_gdt[host_gdt_descriptor_count];
+  // the guest CR3 that was seen during the last vm-exit
+  uint64_t last_seen_guest_cr3;
 
-  // host task state segment
-  alignas(0x1000) task_state_segment_64 host_tss;
+  // TSC when the current RDTSC exiting window closes, or 0 if RDTSC
+  // doesn't currently cause a vm-exit
+  uint64_t rdtsc_window_end;
 
-  // EPT paging structures
-  alignas(0x1000) vcpu_ept_data ept;
+  // the number of NMIs that need to be delivered
+  uint32_t volatile queued_nmis;
+
+  // whether to use TSC offsetting for the current vm-exit--false by default
+  bool hide_vm_exit_overhead;
+
+  // whether to devirtualize the current VCPU
+  bool stop_virtualization;
+
+  // whether MOV to CR3 causes a vm-exit (for CR3 values that aren't in
+  // the CR3-target list). when disabled, the guest CR3 is sampled on
+  // every vm-exit instead
+  bool cr3_load_exiting;
+
+  // whether the guest is single-stepping over a MOV to CR3
+  bool cr3_mtf_pending;
 
   // vm-exit MSR store area
   struct alignas(0x10) {
@@ -71,41 +133,94 @@ struct vcpu {
     vmx_msr_entry perf_global_ctrl;
     vmx_msr_entry aperf;
     vmx_msr_entry mperf;
+
+    // only the first pmc_count entries are stored
+    vmx_msr_entry pmcs[max_pmc_count];
   } msr_exit_store;
 
   // vm-entry MSR load area
   struct alignas(0x10) {
     vmx_msr_entry aperf;
     vmx_msr_entry mperf;
+
+    // only the first pmc_count entries are loaded
+    vmx_msr_entry pmcs[max_pmc_count];
   } msr_entry_load;
 
+  // performance counters that are currently in the MSR areas
+  uint32_t pmc_count;
+  vcpu_pmc pmcs[max_pmc_count];
+
+  // the guest IA32_PERF_GLOBAL_CTRL that the MSR areas were built for
+  uint64_t pmc_perf_global_ctrl;
+
+  // the overhead of a world-transition for every fixed-function counter
+  uint64_t vm_exit_fixed_ctr_overheads[max_fixed_ctr_count];
+
   // cached values that are assumed to NEVER change
   vcpu_cached_data cached;
 
-  // pointer to the current guest context, set in exit-handler
-  guest_context* ctx;
+  // cached guest values that are expensive to look up
+  vcpu_introspection_cache introspection;
 
-  // the number of NMIs that need to be delivered
-  uint32_t volatile queued_nmis;
+  // the TSC overhead of a world-transition for every basic exit reason.
+  // this doesn't include the time that is spent in the exit handler
+  uint64_t vm_exit_tsc_overheads[vm_exit_reason_count];
 
-  // current TSC offset
-  uint64_t tsc_offset;
+  // the number of TSC ticks that the last exit handler took
+  uint64_t volatile last_exit_handler_tsc;
 
-  // current preemption timer
-  uint64_t preemption_timer;
+  // used to decide when the vm-exit overhead should be recalibrated
+  vcpu_overhead_calibration calibration;
 
-  // the overhead caused by world-transitions
-  uint64_t vm_exit_tsc_overhead;
-  uint64_t vm_exit_mperf_overhead;
-  uint64_t vm_exit_ref_tsc_overhead;
+  // the current timing mode and the length of RDTSC exiting windows
+  timing_mode active_timing_mode;
+  uint64_t    rdtsc_window_ticks;
 
-  // whether to use TSC offsetting for the current vm-exit--false by default
-  bool hide_vm_exit_overhead;
+  // the number of vm-exits for every basic exit reason
+  uint64_t exit_reason_counts[vm_exit_reason_count];
 
-  // whether to devirtualize the current VCPU
-  bool stop_virtualization;
+  // guest CR3s that this vcpu recently indexed the process for,
+  // direct-mapped by PFN
+  vcpu_indexed_guest_cr3 indexed_guest_cr3s[indexed_guest_cr3_count];
+
+  // 4 KiB vmxon region
+  alignas(0x1000) vmxon vmxon;
+
+  // 4 KiB vmcs region
+  alignas(0x1000) vmcs vmcs;
+
+  // 4 KiB msr bitmap
+  alignas(0x1000) vmx_msr_bitmap msr_bitmap;
+
+  // host stack used for handling vm-exits
+  alignas(0x1000) uint8_t host_stack[host_stack_size];
+
+  // host interrupt descriptor table
+  alignas(0x1000) segment_descriptor_interrupt_gate_64 host_idt[host_idt_descriptor_count];
+
+  // host global descriptor table
+  alignas(0x1000) segment_descriptor_32 host_gdt[host_gdt_descriptor_count];
+
+  // host task state segment
+  alignas(0x1000) task_state_segment_64 host_tss;
+
+  // EPT paging structures
+  alignas(0x1000) vcpu_ept_data ept;
 };
 
+// the per-exit fields should fit in a single cache line
+static_assert(offsetof(vcpu, cr3_mtf_pending) < 64,
+  "Hot VCPU fields don't fit in a single cache line.");
+
+// and the MSR areas should start right after them
+static_assert(offsetof(vcpu, msr_exit_store) == 64,
+  "VCPU MSR store area isn't cache-line aligned.");
+
+// the hot fields shouldn't be pushing the tables into another page
+static_assert(offsetof(vcpu, vmxon) == 0x1000,
+  "Hot VCPU fields are larger than a page.");
+
 // virtualize the specified cpu. this assumes that execution is already
 // restricted to the desired logical proocessor.
 bool virtualize_cpu(vcpu* cpu);
@@ -25,10 +25,10 @@ void write_vmcs_ctrl_fields(vcpu* const cpu) {
   // 3.24.6.2
   ia32_vmx_procbased_ctls_register proc_based_ctrl;
   proc_based_ctrl.flags                       = 0;
-//#ifndef NDEBUG
-  proc_based_ctrl.cr3_load_exiting            = 1;
+  // CR3-load exiting is disabled by default, since it causes a vm-exit on
+  // every context switch. it can be enabled with configure_cr3_exiting()
+  proc_based_ctrl.cr3_load_exiting            = 0;
   //proc_based_ctrl.cr3_store_exiting           = 1;
-//#endif
   proc_based_ctrl.use_msr_bitmaps             = 1;
   proc_based_ctrl.use_tsc_offsetting          = 1;
   proc_based_ctrl.activate_secondary_controls = 1;
@@ -44,6 +44,7 @@ void write_vmcs_ctrl_fields(vcpu* const cpu) {
   proc_based_ctrl2.enable_xsaves                    = 1;
   proc_based_ctrl2.enable_user_wait_pause           = 1;
   proc_based_ctrl2.conceal_vmx_from_pt              = 1;
+  // VM functions are only enabled while #VE is on (see enable_ve)
   write_ctrl_proc_based2_safe(proc_based_ctrl2);
 
   // 3.24.7
@@ -95,7 +96,7 @@ void write_vmcs_ctrl_fields(vcpu* const cpu) {
   vmx_vmwrite(VMCS_CTRL_CR4_READ_SHADOW, __readcr4() & ~CR4_VMX_ENABLE_FLAG);
 
   // 3.24.6.7
-  // try to trigger the least amount of CR3 exits as possible
+  // only used when CR3-load exiting is enabled
   vmx_vmwrite(VMCS_CTRL_CR3_TARGET_COUNT,   1);
   vmx_vmwrite(VMCS_CTRL_CR3_TARGET_VALUE_0, ghv.system_cr3.flags);
 
@@ -103,25 +104,31 @@ void write_vmcs_ctrl_fields(vcpu* const cpu) {
   vmx_vmwrite(VMCS_CTRL_MSR_BITMAP_ADDRESS, MmGetPhysicalAddress(&cpu->msr_bitmap).QuadPart);
 
   // 3.24.6.11
-  ept_pointer eptp;
-  eptp.flags                                = 0;
-  eptp.memory_type                          = MEMORY_TYPE_WRITE_BACK;
-  eptp.page_walk_length                     = 3;
-  eptp.enable_access_and_dirty_flags        = 0;
-  eptp.enable_supervisor_shadow_stack_pages = 0;
-  eptp.page_frame_number                    = MmGetPhysicalAddress(&cpu->ept.pml4).QuadPart >> 12;
-  vmx_vmwrite(VMCS_CTRL_EPT_POINTER, eptp.flags);
+  vmx_vmwrite(VMCS_CTRL_EPT_POINTER, cpu->ept.eptp_list[ept_view_primary].flags);
 
   // 3.24.6.12
   vmx_vmwrite(VMCS_CTRL_VIRTUAL_PROCESSOR_IDENTIFIER, guest_vpid);
 
+  // 3.24.6.14
+  // VM functions are only enabled while #VE is enabled (see hc::enable_ve())
+  if (cpu->cached.vmfunc.eptp_switching) {
+    vmx_vmwrite(VMCS_CTRL_VMFUNC_CONTROLS, 1);
+    vmx_vmwrite(VMCS_CTRL_EPT_POINTER_LIST_ADDRESS,
+      MmGetPhysicalAddress(&cpu->ept.eptp_list).QuadPart);
+  }
+
+  // 3.24.6.18
+  // PML is only enabled once dirty page tracking is requested
+  if (cpu->cached.procbased_ctls2_allowed1.enable_pml) {
+    vmx_vmwrite(VMCS_CTRL_PML_ADDRESS, MmGetPhysicalAddress(&cpu->ept.pml).QuadPart);
+    vmx_vmwrite(VMCS_GUEST_PML_INDEX,  ept_pml_entry_count - 1);
+  }
+
   // 3.24.7.2
   cpu->msr_exit_store.tsc.msr_idx              = IA32_TIME_STAMP_COUNTER;
   cpu->msr_exit_store.perf_global_ctrl.msr_idx = IA32_PERF_GLOBAL_CTRL;
   cpu->msr_exit_store.aperf.msr_idx            = IA32_APERF;
   cpu->msr_exit_store.mperf.msr_idx            = IA32_MPERF;
-  vmx_vmwrite(VMCS_CTRL_VMEXIT_MSR_STORE_COUNT,
-    sizeof(cpu->msr_exit_store) / 16);
   vmx_vmwrite(VMCS_CTRL_VMEXIT_MSR_STORE_ADDRESS,
     MmGetPhysicalAddress(&cpu->msr_exit_store).QuadPart);
 
@@ -134,11 +141,13 @@ void write_vmcs_ctrl_fields(vcpu* const cpu) {
   cpu->msr_entry_load.mperf.msr_idx = IA32_MPERF;
   cpu->msr_entry_load.aperf.msr_data = __readmsr(IA32_APERF);
   cpu->msr_entry_load.mperf.msr_data = __readmsr(IA32_MPERF);
-  vmx_vmwrite(VMCS_CTRL_VMENTRY_MSR_LOAD_COUNT,
-    sizeof(cpu->msr_entry_load) / 16);
   vmx_vmwrite(VMCS_CTRL_VMENTRY_MSR_LOAD_ADDRESS,
     MmGetPhysicalAddress(&cpu->msr_entry_load).QuadPart);
 
+  // guest PMCs are added to the MSR areas on the first vm-exit where
+  // the guest has counters enabled. this also writes the MSR counts
+  update_pmc_msr_areas(cpu, 0);
+
   // 3.24.8.3
   vmx_vmwrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, 0);
   vmx_vmwrite(VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE,           0);
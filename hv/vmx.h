@@ -132,6 +132,9 @@ void enable_monitor_trap_flag();
 // disable MTF exiting
 void disable_monitor_trap_flag();
 
+// enable/disable vm-exits when the guest executes RDTSC or RDTSCP
+void set_rdtsc_exiting(bool enable_exiting);
+
 } // namespace hv
 
 #include "vmx.inl"
@@ -357,5 +357,12 @@ inline void disable_monitor_trap_flag() {
   write_ctrl_proc_based(control);
 }
 
+// enable/disable vm-exits when the guest executes RDTSC or RDTSCP
+inline void set_rdtsc_exiting(bool const enable_exiting) {
+  auto control = read_ctrl_proc_based();
+  control.rdtsc_exiting = enable_exiting;
+  write_ctrl_proc_based(control);
+}
+
 } // namespace hv
 
@@ -0,0 +1,174 @@
+#include "test.h"
+
+#include "dump-stream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace tests {
+
+namespace {
+
+// the contents of a fake image, which only depends on its base and size
+std::vector<uint8_t> make_image(uint64_t const base, uint64_t const size) {
+  std::vector<uint8_t> image(static_cast<size_t>(size));
+
+  auto state = base | 1;
+  for (auto& b : image) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    b = static_cast<uint8_t>(state);
+  }
+
+  return image;
+}
+
+// a fake image source that serves images from memory, instead of from the
+// hypervisor. chunks at or past an image's fail_offset can't be read.
+struct fake_source {
+  explicit fake_source(std::vector<dump::dump_job> const& jobs) {
+    for (auto const& job : jobs)
+      images[job.base] = make_image(job.base, job.size);
+  }
+
+  bool read_chunk(dump::dump_job const& job,
+      uint64_t const offset, uint8_t* const buffer, size_t const size) const {
+    auto const fail = fail_offsets.find(job.base);
+    if (fail != fail_offsets.end() && offset + size > fail->second)
+      return false;
+
+    memcpy(buffer, images.at(job.base).data() + offset, size);
+    return true;
+  }
+
+  dump::read_chunk_fn reader() const {
+    return [this](dump::dump_job const& job,
+        uint64_t const offset, uint8_t* const buffer, size_t const size) {
+      return read_chunk(job, offset, buffer, size);
+    };
+  }
+
+  std::map<uint64_t, std::vector<uint8_t>> images;
+  std::map<uint64_t, uint64_t> fail_offsets;
+};
+
+std::vector<uint8_t> read_file(std::string const& path) {
+  std::ifstream file(path, std::ios::binary);
+  return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+bool file_exists(std::string const& path) {
+  return std::ifstream(path).is_open();
+}
+
+std::vector<dump::dump_job> make_jobs(size_t const count, uint64_t const size) {
+  std::vector<dump::dump_job> jobs;
+
+  for (size_t i = 0; i < count; ++i) {
+    auto const name = "image" + std::to_string(i);
+    jobs.push_back({ name, 0xFFFFF80000000000 + i * 0x100000,
+      size + i * 0x123, "dump-test-" + name + ".dump" });
+  }
+
+  return jobs;
+}
+
+void test_dump_images() {
+  auto jobs = make_jobs(8, 0x30000);
+
+  // one image that is smaller than a chunk
+  jobs[5].size = 0x321;
+
+  fake_source source(jobs);
+
+  // one image that can't be read at all, and one that fails halfway through
+  source.fail_offsets[jobs[3].base] = 0;
+  source.fail_offsets[jobs[6].base] = 0x18000;
+
+  auto const results = dump::dump_images(source.reader(), jobs, 3, 0x8000);
+  TEST_CHECK(results.size() == jobs.size());
+
+  for (size_t i = 0; i < jobs.size() && i < results.size(); ++i) {
+    auto const& job    = jobs[i];
+    auto const& result = results[i];
+
+    TEST_CHECK(result.name == job.name);
+
+    if (source.fail_offsets.count(job.base)) {
+      TEST_CHECK(!result.success);
+      TEST_CHECK(!file_exists(job.path));
+      continue;
+    }
+
+    auto const& image   = source.images.at(job.base);
+    auto const contents = read_file(job.path);
+
+    dump::fnv1a hash;
+    hash.update(image.data(), image.size());
+
+    TEST_CHECK(result.success);
+    TEST_CHECK(contents == image);
+    TEST_CHECK(result.hash == hash.value);
+
+    std::remove(job.path.c_str());
+  }
+}
+
+// throughput (in MB/s) of the best of a few runs
+double measure_dump_images(fake_source const& source,
+    std::vector<dump::dump_job> const& jobs, size_t const thread_count) {
+  uint64_t total_size = 0;
+  for (auto const& job : jobs)
+    total_size += job.size;
+
+  double best = 0.0;
+
+  for (int run = 0; run < 3; ++run) {
+    auto const start   = std::chrono::steady_clock::now();
+    auto const results = dump::dump_images(source.reader(), jobs, thread_count);
+    auto const end     = std::chrono::steady_clock::now();
+
+    for (auto const& result : results)
+      TEST_CHECK(result.success);
+
+    auto const seconds = std::chrono::duration<double>(end - start).count();
+    best = std::max(best, total_size / seconds / (1024 * 1024));
+  }
+
+  for (auto const& job : jobs)
+    std::remove(job.path.c_str());
+
+  return best;
+}
+
+void bench_dump_images() {
+  auto const jobs = make_jobs(16, 0x400000);
+
+  // generate the images ahead of time so that only the dumping is measured
+  fake_source const source(jobs);
+
+  auto const single = measure_dump_images(source, jobs, 1);
+  auto const multi  = measure_dump_images(source, jobs, 0);
+
+  printf("dump_images (1 thread):    %.1f MB/s\n", single);
+  printf("dump_images (all threads): %.1f MB/s\n", multi);
+
+  // dumping concurrently should never be slower (with some room for noise)
+  TEST_CHECK(multi >= single * 0.9);
+}
+
+} // namespace
+
+void run_dump_stream_tests() {
+  test_dump_images();
+  bench_dump_images();
+}
+
+} // namespace tests
@@ -0,0 +1,222 @@
+#include "test.h"
+
+#include "log-collector.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace tests {
+
+namespace {
+
+// a simulated hypervisor log buffer that hands out records in small batches
+struct simulated_source {
+  explicit simulated_source(std::vector<logs::log_record> records)
+    : records(std::move(records)) {}
+
+  uint32_t drain(logs::log_record* const buffer, uint32_t const max_count) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // never hand out a full batch at once, like a real ring buffer that
+    // is being filled while it is drained
+    auto count = std::min<size_t>(max_count / 3 + 1, records.size() - next);
+    for (size_t i = 0; i < count; ++i)
+      buffer[i] = records[next++];
+
+    return static_cast<uint32_t>(count);
+  }
+
+  std::mutex mutex;
+  std::vector<logs::log_record> records;
+  size_t next = 0;
+};
+
+// records with gaps in their ids and with TSCs that go backwards, just
+// like records that were logged on different cpus
+std::vector<logs::log_record> make_records(size_t const count) {
+  std::vector<logs::log_record> records(count);
+
+  uint64_t id  = 1;
+  uint64_t tsc = 0x123456789;
+
+  for (size_t i = 0; i < count; ++i) {
+    auto& record = records[i];
+    memset(&record, 0, sizeof(record));
+
+    id  += (i % 97 == 0) ? 5 : 1;
+    tsc += (i % 7 == 0) ? uint64_t(-int64_t(i * 13)) : i * 31;
+
+    record.id      = id;
+    record.tsc     = tsc;
+    record.aux     = static_cast<uint32_t>(i % 16);
+    record.channel = static_cast<uint32_t>(i % 5);
+
+    auto const msg = "message " + std::to_string(i) + std::string(i % 150, 'x');
+    snprintf(record.data, sizeof(record.data), "%s", msg.c_str());
+  }
+
+  return records;
+}
+
+bool same_record(logs::log_record const& a, logs::log_record const& b) {
+  return a.id == b.id && a.tsc == b.tsc && a.aux == b.aux && a.channel == b.channel &&
+    strncmp(a.data, b.data, logs::log_record::max_msg_length) == 0;
+}
+
+// run the collector over a simulated source and return the decoded records
+std::vector<logs::log_record> collect(logs::log_collector& collector) {
+  collector.start();
+  collector.stop();
+
+  std::vector<logs::log_record> decoded;
+  for (auto const& path : collector.files)
+    TEST_CHECK(logs::read_log_file(path, decoded));
+
+  return decoded;
+}
+
+logs::collector_config make_config(std::string const& prefix) {
+  logs::collector_config config;
+  config.path_prefix       = prefix;
+  config.max_file_size     = 0x4000;
+  config.min_poll_interval = std::chrono::microseconds(10);
+  config.max_poll_interval = std::chrono::microseconds(100);
+  config.queue_capacity    = 0x10000;
+  return config;
+}
+
+void remove_files(logs::log_collector const& collector) {
+  for (auto const& path : collector.files)
+    std::remove(path.c_str());
+}
+
+void test_varints() {
+  uint64_t const values[] = { 0, 1, 0x7F, 0x80, 0x3FFF, 0x4000,
+    0xFFFFFFFF, 0x8000000000000000, ~0ull };
+
+  for (auto const value : values) {
+    uint8_t buffer[10];
+    auto const size = logs::encode_varint(buffer, value);
+
+    uint64_t decoded = 0;
+    TEST_CHECK(logs::decode_varint(buffer, size, decoded) == size);
+    TEST_CHECK(decoded == value);
+
+    // truncated varints are rejected
+    TEST_CHECK(size == 1 || logs::decode_varint(buffer, size - 1, decoded) == 0);
+  }
+}
+
+void test_round_trip() {
+  auto const records = make_records(5000);
+  simulated_source source(records);
+
+  logs::log_collector collector([&](logs::log_record* const buffer, uint32_t const count) {
+    return source.drain(buffer, count);
+  }, make_config("hvlog-test-round-trip"));
+  collector.config.max_file_count = 0;
+
+  auto const decoded = collect(collector);
+
+  TEST_CHECK(collector.stats.drained == records.size());
+  TEST_CHECK(collector.stats.written == records.size());
+  TEST_CHECK(collector.stats.dropped_by_queue == 0);
+  TEST_CHECK(collector.stats.open_failures == 0);
+  TEST_CHECK(collector.stats.files_written > 1);
+  TEST_CHECK(collector.stats.files_written == collector.files.size());
+
+  // every 97th record skipped 4 ids
+  TEST_CHECK(collector.stats.dropped_by_hv == 4 * ((records.size() - 1) / 97));
+
+  TEST_CHECK(decoded.size() == records.size());
+  for (size_t i = 0; i < decoded.size() && i < records.size(); ++i)
+    TEST_CHECK(same_record(decoded[i], records[i]));
+
+  remove_files(collector);
+}
+
+void test_file_count_limit() {
+  auto const records = make_records(5000);
+  simulated_source source(records);
+
+  logs::log_collector collector([&](logs::log_record* const buffer, uint32_t const count) {
+    return source.drain(buffer, count);
+  }, make_config("hvlog-test-limit"));
+  collector.config.max_file_count = 2;
+
+  auto const decoded = collect(collector);
+
+  TEST_CHECK(collector.files.size() == 2);
+  TEST_CHECK(collector.stats.files_removed == collector.stats.files_written - 2);
+
+  // the remaining files hold the newest records
+  TEST_CHECK(!decoded.empty() && decoded.size() < records.size());
+  if (!decoded.empty())
+    TEST_CHECK(same_record(decoded.back(), records.back()));
+
+  remove_files(collector);
+}
+
+void test_no_overwrite() {
+  auto const records = make_records(100);
+
+  auto const run = [&] {
+    simulated_source source(records);
+
+    auto collector = std::make_unique<logs::log_collector>(
+      [&](logs::log_record* const buffer, uint32_t const count) {
+        return source.drain(buffer, count);
+      }, make_config("hvlog-test-overwrite"));
+
+    collect(*collector);
+    return collector;
+  };
+
+  // the second run will usually start in the same second as the first
+  auto const first  = run();
+  auto const second = run();
+
+  for (auto const& collector : { first.get(), second.get() }) {
+    std::vector<logs::log_record> decoded;
+    for (auto const& path : collector->files)
+      TEST_CHECK(logs::read_log_file(path, decoded));
+
+    TEST_CHECK(decoded.size() == records.size());
+  }
+
+  remove_files(*first);
+  remove_files(*second);
+}
+
+void test_corrupt_files() {
+  std::vector<logs::log_record> decoded;
+
+  // bad magic
+  uint8_t const bad_magic[] = { 'H', 'V', 'L', 'O', 'G', 0x02 };
+  TEST_CHECK(!logs::decode_log_file(bad_magic, sizeof(bad_magic), decoded));
+
+  // truncated record: the length says 5 bytes but only 2 follow
+  uint8_t const truncated[] = { 'H', 'V', 'L', 'O', 'G', 0x01, 2, 2, 0, 0, 5, 'h', 'i' };
+  TEST_CHECK(!logs::decode_log_file(truncated, sizeof(truncated), decoded));
+  TEST_CHECK(decoded.empty());
+
+  // an empty file is valid
+  TEST_CHECK(logs::decode_log_file(truncated, 6, decoded));
+  TEST_CHECK(decoded.empty());
+}
+
+} // namespace
+
+void run_log_collector_tests() {
+  test_varints();
+  test_round_trip();
+  test_file_count_limit();
+  test_no_overwrite();
+  test_corrupt_files();
+}
+
+} // namespace tests
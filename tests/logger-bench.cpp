@@ -0,0 +1,218 @@
+#include "test.h"
+
+#include "logger-format.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstring>
+
+namespace tests {
+
+namespace {
+
+using hv::logger_max_msg_length;
+
+// the varargs formatter that the logger used before format strings were
+// parsed at compile-time, copied verbatim as a baseline
+void logger_format(char* const buffer, char const* const format, va_list& args) {
+  uint32_t buffer_idx = 0;
+  uint32_t format_idx = 0;
+
+  // true if the last character was a '%'
+  bool specifying = false;
+
+  while (true) {
+    auto const c = format[format_idx++];
+
+    // format end has been reached
+    if (c == '\0')
+      break;
+
+    if (c == '%') {
+      specifying = true;
+      continue;
+    }
+
+    // just copy the character directly
+    if (!specifying) {
+      buffer[buffer_idx++] = c;
+
+      // buffer end has been reached
+      if (buffer_idx >= logger_max_msg_length - 1)
+        break;
+
+      specifying = false;
+      continue;
+    }
+
+    char fmt_buffer[128];
+
+    // format the string according to the specifier
+    switch (c) {
+    case 's': {
+      if (hv::logger_format_copy_str(buffer, va_arg(args, char const*), buffer_idx))
+        return;
+      break;
+    }
+    case 'd':
+    case 'i': {
+      if (hv::logger_format_copy_str(buffer,
+          hv::lukas_itoa(va_arg(args, int), fmt_buffer, 10), buffer_idx))
+        return;
+      break;
+    }
+    case 'u': {
+      if (hv::logger_format_copy_str(buffer,
+          hv::lukas_itoa(va_arg(args, unsigned int), fmt_buffer, 10), buffer_idx))
+        return;
+      break;
+    }
+    case 'x': {
+      if (hv::logger_format_copy_str(buffer, "0x", buffer_idx))
+        return;
+      if (hv::logger_format_copy_str(buffer,
+          hv::lukas_itoa(va_arg(args, unsigned int), fmt_buffer, 16), buffer_idx))
+        return;
+      break;
+    }
+    case 'X': {
+      if (hv::logger_format_copy_str(buffer, "0x", buffer_idx))
+        return;
+      if (hv::logger_format_copy_str(buffer,
+          hv::lukas_itoa(va_arg(args, unsigned int), fmt_buffer, 16, true), buffer_idx))
+        return;
+      break;
+    }
+    case 'p': {
+      if (hv::logger_format_copy_str(buffer, "0x", buffer_idx))
+        return;
+      if (hv::logger_format_copy_str(buffer,
+          hv::lukas_itoa(va_arg(args, uint64_t), fmt_buffer, 16, true), buffer_idx))
+        return;
+      break;
+    }
+    }
+
+    specifying = false;
+  }
+
+  buffer[buffer_idx] = '\0';
+}
+
+void runtime_format(char* const buffer, char const* const format, ...) {
+  va_list args;
+  va_start(args, format);
+  logger_format(buffer, format, args);
+  va_end(args);
+}
+
+// the same steps as hv::logger_write_typed(), but into a buffer
+template <typename FormatFn, typename... Args>
+void typed_format(char* const buffer, FormatFn const format_fn, Args const... args) {
+  static constexpr char const* format = format_fn();
+  static constexpr auto layout = hv::logger_parse_format<sizeof...(Args)>(format);
+
+  static_assert(layout.valid);
+  static_assert(hv::logger_args_match<Args...>(layout.spec));
+
+  hv::logger_arg const serialized[sizeof...(Args) + 1] = { hv::logger_make_arg(args)... };
+
+  hv::logger_format_args(buffer, format, layout.literal_start,
+    layout.literal_length, layout.spec, serialized, sizeof...(Args));
+}
+
+#define TYPED_FORMAT(buffer, fmt, ...) \
+  typed_format(buffer, []() constexpr { return fmt; }, ##__VA_ARGS__)
+
+// the number of messages that are formatted by format_*_messages()
+constexpr size_t message_count = 4;
+
+using message_buffers = char[message_count][logger_max_msg_length];
+
+// a few messages that look like the ones that the hypervisor logs
+void format_runtime_messages(message_buffers& buffers, uint64_t const i) {
+  runtime_format(buffers[0], "Logger initialized.");
+  runtime_format(buffers[1], "Injecting interrupt %X (error=%u).",
+    uint32_t(i & 0xFF), uint32_t(i));
+  runtime_format(buffers[2], "MMR access: rip=%p gpa=%p size=%i.",
+    uint64_t(0xFFFFF80012345678 + i), uint64_t(0x1000 * i), int(i & 7) - 4);
+  runtime_format(buffers[3], "Process %s (pid=%u) was indexed.",
+    "explorer.exe", uint32_t(i));
+}
+
+void format_typed_messages(message_buffers& buffers, uint64_t const i) {
+  TYPED_FORMAT(buffers[0], "Logger initialized.");
+  TYPED_FORMAT(buffers[1], "Injecting interrupt %X (error=%u).",
+    uint32_t(i & 0xFF), uint32_t(i));
+  TYPED_FORMAT(buffers[2], "MMR access: rip=%p gpa=%p size=%i.",
+    uint64_t(0xFFFFF80012345678 + i), uint64_t(0x1000 * i), int(i & 7) - 4);
+  TYPED_FORMAT(buffers[3], "Process %s (pid=%u) was indexed.",
+    "explorer.exe", uint32_t(i));
+}
+
+// prevent the formatting from being optimized away
+volatile char sink;
+
+// nanoseconds per formatted message
+double measure(void (*const format_messages)(message_buffers&, uint64_t)) {
+  constexpr size_t iterations = 1'000'000;
+
+  message_buffers buffers;
+  char checksum = 0;
+
+  auto const start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < iterations; ++i) {
+    format_messages(buffers, i);
+
+    for (auto const& buffer : buffers)
+      checksum ^= buffer[i % 16];
+  }
+
+  auto const end = std::chrono::steady_clock::now();
+
+  sink = checksum;
+
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+    (iterations * message_count);
+}
+
+void test_same_output() {
+  for (uint64_t i = 0; i < 1000; i += 37) {
+    message_buffers runtime, typed;
+    format_runtime_messages(runtime, i);
+    format_typed_messages(typed, i);
+
+    for (size_t j = 0; j < message_count; ++j)
+      TEST_CHECK(strcmp(runtime[j], typed[j]) == 0);
+  }
+
+  // long messages are truncated at the same spot
+  char runtime[logger_max_msg_length];
+  char typed[logger_max_msg_length];
+  auto const long_str = "0123456789012345678901234567890123456789012345678901234567890123456789"
+                        "0123456789012345678901234567890123456789012345678901234567890123456789";
+
+  runtime_format(runtime, "long: %s %u", long_str, 5u);
+  TYPED_FORMAT(typed, "long: %s %u", long_str, 5u);
+  TEST_CHECK(strcmp(runtime, typed) == 0);
+  TEST_CHECK(strlen(typed) == logger_max_msg_length - 1);
+}
+
+void bench_formatters() {
+  auto const runtime_ns = measure(format_runtime_messages);
+  auto const typed_ns   = measure(format_typed_messages);
+
+  printf("varargs logger_format():     %.1f ns/msg\n", runtime_ns);
+  printf("typed logger_format_args():  %.1f ns/msg (%.2fx faster)\n",
+    typed_ns, runtime_ns / typed_ns);
+}
+
+} // namespace
+
+void run_logger_benchmarks() {
+  test_same_output();
+  bench_formatters();
+}
+
+} // namespace tests
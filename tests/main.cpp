@@ -0,0 +1,15 @@
+#include "test.h"
+
+int main() {
+  tests::run_log_collector_tests();
+  tests::run_logger_benchmarks();
+  tests::run_dump_stream_tests();
+
+  if (tests::failures) {
+    printf("%d check(s) failed.\n", tests::failures);
+    return 1;
+  }
+
+  printf("All tests passed.\n");
+  return 0;
+}
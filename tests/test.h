@@ -0,0 +1,32 @@
+#pragma once
+
+// a tiny test harness. the tests only depend on the standard library so
+// that they can be built and run on any platform, e.g.:
+//   g++ -std=c++17 -O2 -pthread -I../um -I../hv -o tests *.cpp
+//     ../um/log-collector.cpp ../um/dump-stream.cpp
+
+#include <cstdio>
+
+namespace tests {
+
+// number of checks that failed
+inline int failures = 0;
+
+// collector tests (log-collector-test.cpp)
+void run_log_collector_tests();
+
+// compares the compile-time logger formatting against the old varargs
+// formatter (logger-bench.cpp)
+void run_logger_benchmarks();
+
+// dumps images from a fake image source (dump-stream-test.cpp)
+void run_dump_stream_tests();
+
+} // namespace tests
+
+#define TEST_CHECK(expr) do {                                          \
+  if (!(expr)) {                                                       \
+    ++tests::failures;                                                 \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr);    \
+  }                                                                    \
+} while (0)
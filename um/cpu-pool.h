@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+#include <Windows.h>
+
+namespace hv {
+
+// a pool of worker threads where each thread is pinned to a different
+// logical processor. this lets per-cpu work (e.g. hypercalls that only
+// affect the current vcpu) run on every processor at the same time
+// instead of migrating a single thread from one processor to the next.
+struct cpu_pool {
+  cpu_pool();
+  ~cpu_pool();
+
+  cpu_pool(cpu_pool const&) = delete;
+  cpu_pool& operator=(cpu_pool const&) = delete;
+
+  // call fn(cpu_index) on every logical processor concurrently and
+  // wait until every processor has finished
+  void run(std::function<void(uint32_t)> const& fn);
+
+  // number of logical processors (across every processor group)
+  uint32_t cpu_count() const { return static_cast<uint32_t>(threads.size()); }
+
+  // per-cpu worker thread
+  void worker(uint32_t cpu_index, uint16_t group, uint8_t group_index);
+
+  std::vector<std::thread> threads;
+
+  // run() is not reentrant
+  std::mutex run_mutex;
+
+  std::mutex              mutex;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+
+  // the current job, only valid while a run() is in progress
+  std::function<void(uint32_t)> const* job = nullptr;
+
+  // incremented every time that a new job is started
+  uint64_t generation = 0;
+
+  // number of workers that haven't finished the current job yet
+  uint32_t remaining = 0;
+
+  bool stopping = false;
+};
+
+inline cpu_pool::cpu_pool() {
+  uint32_t cpu_index = 0;
+
+  // systems with more than 64 logical processors have multiple groups
+  auto const group_count = GetActiveProcessorGroupCount();
+
+  for (uint16_t group = 0; group < group_count; ++group) {
+    auto const count = GetActiveProcessorCount(group);
+
+    for (uint32_t i = 0; i < count; ++i, ++cpu_index) {
+      threads.emplace_back(&cpu_pool::worker, this,
+        cpu_index, group, static_cast<uint8_t>(i));
+    }
+  }
+}
+
+inline cpu_pool::~cpu_pool() {
+  {
+    std::lock_guard lock(mutex);
+    stopping = true;
+  }
+
+  start_cv.notify_all();
+
+  for (auto& t : threads)
+    t.join();
+}
+
+// call fn(cpu_index) on every logical processor concurrently
+inline void cpu_pool::run(std::function<void(uint32_t)> const& fn) {
+  std::lock_guard run_lock(run_mutex);
+  std::unique_lock lock(mutex);
+
+  job       = &fn;
+  remaining = cpu_count();
+  ++generation;
+
+  start_cv.notify_all();
+
+  // wait for every worker to reach the barrier
+  done_cv.wait(lock, [&] { return remaining == 0; });
+
+  job = nullptr;
+}
+
+inline void cpu_pool::worker(uint32_t const cpu_index,
+    uint16_t const group, uint8_t const group_index) {
+  GROUP_AFFINITY affinity = {};
+  affinity.Group = group;
+  affinity.Mask  = KAFFINITY(1) << group_index;
+
+  // pin this thread to its logical processor for the rest of its lifetime
+  SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+
+  uint64_t last_generation = 0;
+
+  while (true) {
+    std::function<void(uint32_t)> const* curr_job = nullptr;
+
+    {
+      std::unique_lock lock(mutex);
+      start_cv.wait(lock, [&] {
+        return stopping || generation != last_generation; });
+
+      if (stopping)
+        return;
+
+      last_generation = generation;
+      curr_job = job;
+    }
+
+    (*curr_job)(cpu_index);
+
+    {
+      std::lock_guard lock(mutex);
+      if (--remaining != 0)
+        continue;
+    }
+
+    done_cv.notify_one();
+  }
+}
+
+// get the cpu pool that is shared by the whole process
+inline cpu_pool& global_cpu_pool() {
+  static cpu_pool pool;
+  return pool;
+}
+
+// call fn() on every logical processor concurrently
+template <typename Fn>
+inline void for_each_cpu_parallel(Fn const& fn) {
+  global_cpu_pool().run([&](uint32_t const i) { fn(i); });
+}
+
+} // namespace hv
+
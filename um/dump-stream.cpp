@@ -0,0 +1,193 @@
+#include "dump-stream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace dump {
+
+// number of chunks that can be waiting to be written to disk
+inline constexpr size_t write_queue_depth = 4;
+
+void fnv1a::update(void const* const data, size_t const size) {
+  auto const bytes = static_cast<uint8_t const*>(data);
+
+  for (size_t i = 0; i < size; ++i) {
+    value ^= bytes[i];
+    value *= 0x100000001B3;
+  }
+}
+
+// chunks that have been read and are waiting to be written to disk. the
+// reader fills the buffers in order and a single writer drains them.
+struct chunk_queue {
+  explicit chunk_queue(size_t const chunk_size) {
+    for (auto& buffer : buffers)
+      buffer = std::make_unique<uint8_t[]>(chunk_size);
+  }
+
+  std::unique_ptr<uint8_t[]> buffers[write_queue_depth];
+  size_t sizes[write_queue_depth] = {};
+
+  std::mutex              mutex;
+  std::condition_variable cv;
+
+  // number of chunks that were read and written so far
+  size_t read    = 0;
+  size_t written = 0;
+
+  // set by the reader once there are no more chunks
+  bool done = false;
+
+  // set by the writer if writing to the file failed
+  bool failed = false;
+};
+
+// write every chunk in the queue to the file until the reader is done
+static void write_chunks(chunk_queue& queue, std::ofstream& file) {
+  while (true) {
+    uint8_t const* buffer = nullptr;
+    size_t size = 0;
+
+    {
+      std::unique_lock<std::mutex> lock(queue.mutex);
+      queue.cv.wait(lock, [&] { return queue.written < queue.read || queue.done; });
+
+      if (queue.written == queue.read)
+        return;
+
+      buffer = queue.buffers[queue.written % write_queue_depth].get();
+      size   = queue.sizes[queue.written % write_queue_depth];
+    }
+
+    // the reader won't touch this buffer until written is incremented
+    auto const success = static_cast<bool>(
+      file.write(reinterpret_cast<char const*>(buffer), size));
+
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.written += 1;
+      queue.failed  |= !success;
+    }
+
+    queue.cv.notify_all();
+  }
+}
+
+// dump an image to a file
+dump_result dump_image(read_chunk_fn const& read_chunk,
+    dump_job const& job, size_t const chunk_size) {
+  dump_result result = {};
+  result.name = job.name;
+  result.hash = fnv1a().value;
+
+  chunk_queue queue(chunk_size);
+
+  auto const first_size = static_cast<size_t>(std::min<uint64_t>(chunk_size, job.size));
+
+  // don't create the file if the image can't be read at all
+  if (!read_chunk(job, 0, queue.buffers[0].get(), first_size))
+    return result;
+
+  std::ofstream file(job.path, std::ios::binary);
+  if (!file)
+    return result;
+
+  fnv1a hash;
+  hash.update(queue.buffers[0].get(), first_size);
+
+  queue.sizes[0] = first_size;
+  queue.read     = 1;
+
+  // the writer only ever waits on disk I/O, while we wait on the reads
+  std::thread writer(write_chunks, std::ref(queue), std::ref(file));
+
+  auto read_failed = false;
+
+  for (uint64_t offset = first_size; offset < job.size; offset += chunk_size) {
+    auto const size = static_cast<size_t>(std::min<uint64_t>(chunk_size, job.size - offset));
+
+    uint8_t* buffer = nullptr;
+
+    // wait for a free buffer
+    {
+      std::unique_lock<std::mutex> lock(queue.mutex);
+      queue.cv.wait(lock, [&] {
+        return queue.read - queue.written < write_queue_depth || queue.failed; });
+
+      if (queue.failed)
+        break;
+
+      buffer = queue.buffers[queue.read % write_queue_depth].get();
+    }
+
+    if (!read_chunk(job, offset, buffer, size)) {
+      read_failed = true;
+      break;
+    }
+
+    hash.update(buffer, size);
+
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.sizes[queue.read % write_queue_depth] = size;
+      queue.read += 1;
+    }
+
+    queue.cv.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.done = true;
+  }
+
+  queue.cv.notify_all();
+  writer.join();
+  file.close();
+
+  result.success = !read_failed && !queue.failed;
+  result.hash    = hash.value;
+
+  // don't leave a truncated dump behind
+  if (!result.success)
+    std::remove(job.path.c_str());
+
+  return result;
+}
+
+// dump every image on a pool of worker threads
+std::vector<dump_result> dump_images(read_chunk_fn const& read_chunk,
+    std::vector<dump_job> const& jobs, size_t thread_count, size_t const chunk_size) {
+  std::vector<dump_result> results(jobs.size());
+
+  if (thread_count == 0)
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+  thread_count = std::min(thread_count, jobs.size());
+
+  // workers grab the next job until there are none left
+  std::atomic<size_t> next_job = 0;
+
+  auto const worker = [&] {
+    for (size_t i; (i = next_job++) < jobs.size();)
+      results[i] = dump_image(read_chunk, jobs[i], chunk_size);
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < thread_count; ++i)
+    threads.emplace_back(worker);
+
+  for (auto& t : threads)
+    t.join();
+
+  return results;
+}
+
+} // namespace dump
+
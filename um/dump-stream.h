@@ -0,0 +1,63 @@
+#pragma once
+
+// this file (and dump-stream.cpp) only depends on the standard library so
+// that the streaming logic can be built and benchmarked on any platform
+// against a fake image source (see tests/dump-stream-test.cpp).
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace dump {
+
+// an image that should be dumped
+struct dump_job {
+  std::string name;
+  uint64_t    base;
+  uint64_t    size;
+
+  // file that the image is written to
+  std::string path;
+};
+
+// copy size bytes at the specified offset of an image into a buffer. the
+// PE headers are expected to already be fixed up (hv::dump_module() does
+// this in root-mode). returns false if the chunk couldn't be read.
+using read_chunk_fn = std::function<bool(dump_job const& job,
+  uint64_t offset, uint8_t* buffer, size_t size)>;
+
+// size of the chunks that images are read, hashed, and written in (the
+// same as hv::dump_module_max_size)
+inline constexpr size_t default_chunk_size = 0x10000;
+
+// the result of dumping an image
+struct dump_result {
+  std::string name;
+  bool        success;
+
+  // FNV-1a hash of the dumped image
+  uint64_t hash;
+};
+
+// incremental 64-bit FNV-1a hash
+struct fnv1a {
+  uint64_t value = 0xCBF29CE484222325;
+
+  void update(void const* data, size_t size);
+};
+
+// dump an image to a file. reading and hashing the next chunks is
+// pipelined with writing the previous chunks to disk on a writer thread.
+// no file is left behind if the image couldn't be dumped.
+dump_result dump_image(read_chunk_fn const& read_chunk,
+  dump_job const& job, size_t chunk_size = default_chunk_size);
+
+// dump every image on a pool of worker threads. thread_count of 0
+// uses the number of hardware threads. results are in the same order
+// as the jobs.
+std::vector<dump_result> dump_images(read_chunk_fn const& read_chunk,
+  std::vector<dump_job> const& jobs, size_t thread_count = 0,
+  size_t chunk_size = default_chunk_size);
+
+} // namespace dump
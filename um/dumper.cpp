@@ -1,53 +1,44 @@
 #include "dumper.h"
+#include "dump-stream.h"
 #include "hv.h"
 
 #include <fstream>
+#include <algorithm>
+#include <vector>
+
+// get every kernel module that is currently loaded
+static std::vector<hv::module_info> query_loaded_modules() {
+  // get the number of entries that we need to allocate
+  std::vector<hv::module_info> modules(hv::query_module_list(nullptr, 0) + 0x10);
+  modules.resize(min(modules.size(), hv::query_module_list(modules.data(), modules.size())));
+  return modules;
+}
+
+// copy a loaded driver into a buffer (with its PE headers fixed up) in
+// chunks, so that the hypervisor never spends too long in a single vm-exit
+static bool read_loaded_driver(void* const imagebase,
+    uint8_t* const buffer, size_t const imagesize) {
+  for (size_t offset = 0; offset < imagesize; offset += hv::dump_module_max_size) {
+    auto const size = min(imagesize - offset, hv::dump_module_max_size);
+    if (imagesize != hv::dump_module(imagebase, buffer + offset, offset, size))
+      return false;
+  }
 
-struct RTL_PROCESS_MODULE_INFORMATION {
-  PVOID  Section;
-  PVOID  MappedBase;
-  PVOID  ImageBase;
-  ULONG  ImageSize;
-  ULONG  Flags;
-  USHORT LoadOrderIndex;
-  USHORT InitOrderIdnex;
-  USHORT LoadCount;
-  USHORT OffsetToFileName;
-  CHAR   FullPathName[0x100];
-};
-
-struct RTL_PROCESS_MODULES {
-  ULONG                          NumberOfModules;
-  RTL_PROCESS_MODULE_INFORMATION Modules[1];
-};
+  return true;
+}
 
 // get the image base and image size of a loaded driver
 bool find_loaded_driver(char const* const name, void*& imagebase, uint32_t& imagesize) {
-  using NtQuerySystemInformationFn = NTSTATUS(NTAPI*)(uint32_t SystemInformationClass,
-    PVOID SystemInformation, ULONG SystemInformationLength, PULONG ReturnLength);
-  static auto const NtQuerySystemInformation = (NtQuerySystemInformationFn)(
-    GetProcAddress(GetModuleHandleA("ntdll.dll"), "NtQuerySystemInformation"));
-
-  // get the size of the buffer that we need to allocate
-  unsigned long length = 0;
-  NtQuerySystemInformation(0x0B, nullptr, 0, &length);
-
-  auto const info = (RTL_PROCESS_MODULES*)(new uint8_t[length + 0x200]);
-  NtQuerySystemInformation(0x0B, info, length + 0x200, &length);
-
-  for (unsigned int i = 0; i < info->NumberOfModules; ++i) {
-    auto const& m = info->Modules[i];
-    if (strcmp(m.FullPathName + m.OffsetToFileName, name) != 0)
+  for (auto const& m : query_loaded_modules()) {
+    if (_stricmp(m.name, name) != 0)
       continue;
 
-    imagebase = m.ImageBase;
-    imagesize = m.ImageSize;
+    imagebase = reinterpret_cast<void*>(m.base);
+    imagesize = static_cast<uint32_t>(m.size);
 
-    delete info;
     return true;
   }
 
-  delete info;
   return false;
 }
 
@@ -62,21 +53,11 @@ bool dump_driver(char const* const name, char const* path) {
   if (!find_loaded_driver(name, imagebase, imagesize))
     return false;
 
+  // the hypervisor fixes up the PE headers for us
   auto const buffer = std::make_unique<uint8_t[]>(imagesize);
-  if (imagesize != hv::read_virt_mem(0, buffer.get(), imagebase, imagesize))
+  if (!read_loaded_driver(imagebase, buffer.get(), imagesize))
     return false;
 
-  auto const dos_header = (PIMAGE_DOS_HEADER)&buffer[0];
-  auto const nt_header = (PIMAGE_NT_HEADERS)(&buffer[0] + dos_header->e_lfanew);
-  auto const sections = (PIMAGE_SECTION_HEADER)(nt_header + 1);
-
-  // fix the imagebase field in the PE header
-  nt_header->OptionalHeader.ImageBase = (uintptr_t)imagebase;
-
-  // fix the sections
-  for (size_t i = 0; i < nt_header->FileHeader.NumberOfSections; ++i)
-    sections[i].PointerToRawData = sections[i].VirtualAddress;
-
   char file_name[1024] = {};
 
   if (!path) {
@@ -90,3 +71,34 @@ bool dump_driver(char const* const name, char const* path) {
   return true;
 }
 
+// dump multiple running drivers (or every driver if names is empty)
+// to the specified directory concurrently
+std::vector<dump::dump_result> dump_drivers(
+    std::vector<std::string> const& names, char const* const directory) {
+  if (!hv::is_hv_running())
+    return {};
+
+  std::vector<dump::dump_job> jobs;
+
+  for (auto const& m : query_loaded_modules()) {
+    if (!names.empty() && std::none_of(begin(names), end(names),
+        [&](std::string const& name) { return _stricmp(name.c_str(), m.name) == 0; }))
+      continue;
+
+    char path[1024] = {};
+    sprintf_s(path, "%s\\%s.dump", directory, m.name);
+
+    jobs.push_back({ m.name, m.base, m.size, path });
+  }
+
+  // the hypervisor fixes up the PE headers for us
+  auto const read_chunk = [](dump::dump_job const& job,
+      uint64_t const offset, uint8_t* const buffer, size_t const size) {
+    return job.size == hv::dump_module(reinterpret_cast<void*>(job.base),
+      buffer, static_cast<size_t>(offset), size);
+  };
+
+  static_assert(dump::default_chunk_size <= hv::dump_module_max_size);
+
+  return dump::dump_images(read_chunk, jobs);
+}
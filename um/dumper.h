@@ -1,5 +1,12 @@
 #pragma once
 
+#include "dump-stream.h"
+
 // dump a running driver to a file
 bool dump_driver(char const* name, char const* path = nullptr);
 
+// dump multiple running drivers (or every driver if names is empty)
+// to the specified directory concurrently
+std::vector<dump::dump_result> dump_drivers(
+  std::vector<std::string> const& names, char const* directory = ".");
+
@@ -8,9 +8,36 @@ namespace hv {
 // key used for executing hypercalls
 inline constexpr uint64_t hypercall_key = 69420;
 
+// the most bytes that dump_module() copies in a single hypercall
+inline constexpr uint64_t dump_module_max_size = 0x10000;
+
 // signature that is returned by the ping hypercall
 inline constexpr uint64_t hypervisor_signature = 'fr0g';
 
+// the category that a log message belongs to
+enum logger_channel : uint32_t {
+  logger_channel_info = 0,
+  logger_channel_error,
+  logger_channel_verbose,
+  logger_channel_mmr_access,
+  logger_channel_inject_int,
+  logger_channel_host_exception,
+  logger_channel_count
+};
+
+// what to do when a message is written while the log is full
+enum logger_overflow_policy : uint32_t {
+  // overwrite the oldest message
+  logger_overflow_drop_old = 0,
+
+  // discard the new message
+  logger_overflow_drop_new,
+
+  // discard new MMR accesses (and stop tracing them) until the log is
+  // flushed, while still overwriting the oldest message for every other channel
+  logger_overflow_stall_mmr
+};
+
 struct logger_msg {
   static constexpr uint32_t max_msg_length = 128;
 
@@ -23,10 +50,26 @@ struct logger_msg {
   // process ID of the VCPU that sent the message
   uint32_t aux;
 
+  // logger_channel that this message was written to
+  uint32_t channel;
+
   // null-terminated ascii string
   char data[max_msg_length];
 };
 
+// how vm-exit overhead is hidden from RDTSC
+enum timing_mode : uint32_t {
+  // RDTSC never causes a vm-exit, and only the TSC offset is used
+  timing_mode_offset = 0,
+
+  // RDTSC causes a vm-exit for a short window after every vm-exit whose
+  // overhead was hidden (e.g. the CPUID in RDTSC; CPUID; RDTSC)
+  timing_mode_windowed,
+
+  // RDTSC always causes a vm-exit
+  timing_mode_exit
+};
+
 // hypercall indices
 enum hypercall_code : uint64_t {
   hypercall_ping = 0,
@@ -46,7 +89,24 @@ enum hypercall_code : uint64_t {
   hypercall_get_hv_base,
   hypercall_install_mmr,
   hypercall_remove_mmr,
-  hypercall_remove_all_mmrs
+  hypercall_remove_all_mmrs,
+  hypercall_enable_dirty_logging,
+  hypercall_disable_dirty_logging,
+  hypercall_clear_dirty_pages,
+  hypercall_query_dirty_pages,
+  hypercall_enable_ve,
+  hypercall_disable_ve,
+  hypercall_query_mmr_stats,
+  hypercall_query_process_cr3_batch,
+  hypercall_query_process_list,
+  hypercall_query_module_list,
+  hypercall_dump_module,
+  hypercall_configure_logger,
+  hypercall_query_logger_stats,
+  hypercall_set_logger_channels,
+  hypercall_configure_cr3_exiting,
+  hypercall_query_exit_counts,
+  hypercall_set_timing_mode
 };
 
 // hypercall input
@@ -61,16 +121,81 @@ struct hypercall_input {
   uint64_t args[6];
 };
 
+// MMR statistics that are returned by query_mmr_stats()
+struct mmr_stats {
+  // number of monitored accesses
+  uint64_t access_count;
+
+  // number of accesses that were logged
+  uint64_t logged_count;
+
+  // number of accesses that were dropped because of rate limiting
+  // (or because the logger was full with logger_overflow_stall_mmr)
+  uint64_t dropped_count;
+};
+
+// process information that is returned by query_process_list()
+struct process_info {
+  uint64_t pid;
+  uint64_t eprocess;
+
+  // kernel CR3 (EPROCESS::DirectoryTableBase)
+  uint64_t cr3;
+
+  // EPROCESS::ImageFileName (null-terminated)
+  char image_file_name[16];
+};
+
+// kernel module information that is returned by query_module_list()
+struct module_info {
+  uint64_t base;
+  uint64_t size;
+
+  // KLDR_DATA_TABLE_ENTRY::BaseDllName (null-terminated and truncated to ASCII)
+  char name[64];
+};
+
+// logger statistics that are returned by query_logger_stats()
+struct logger_stats {
+  // the total messages sent (including messages that were dropped)
+  uint64_t total_msg_count;
+
+  // number of messages that are waiting to be flushed
+  uint32_t msg_count;
+
+  // the current size of the log ring
+  uint32_t msg_capacity;
+
+  uint32_t policy;
+  uint32_t mmr_stalled;
+
+  // number of messages that were lost, indexed by logger_channel
+  uint64_t dropped_msg_count[logger_channel_count];
+};
+
 enum mmr_memory_mode {
   mmr_memory_mode_r = 0b001,
   mmr_memory_mode_w = 0b010,
   mmr_memory_mode_x = 0b100
 };
 
+enum mmr_backend {
+  // EPT violation followed by a single-step on every access
+  mmr_backend_ept = 0,
+
+  // hardware write logging through the PML, only supports mmr_memory_mode_w
+  mmr_backend_pml,
+
+  // ept-violations are delivered as a #VE to the handler at IDT vector 20
+  // (see enable_ve()). falls back to mmr_backend_ept if #VE isn't enabled.
+  mmr_backend_ve
+};
+
 // check if the system is virtualized
 bool is_hv_running();
 
-// call fn() on each logical processor
+// call fn() on each logical processor, one processor at a time. see
+// for_each_cpu_parallel() in cpu-pool.h for running on every processor at once
 template <typename Fn>
 void for_each_cpu(Fn fn);
 
@@ -118,8 +243,15 @@ void unhide_physical_page(uint64_t pfn);
 // get the base address of the hypervisor
 void* get_hv_base();
 
-// write to the logger whenever a certain physical memory range is accessed
-void* install_mmr(uint64_t address, uint32_t size, uint8_t mode);
+// write to the logger whenever a certain physical memory range is accessed.
+// only every sample_interval'th access is logged, at most max_events_per_sec
+// accesses are logged per second, and monitoring is suspended on a page for
+// suspend_ticks TSC ticks after it is accessed (0 disables each of these).
+void* install_mmr(uint64_t address, uint32_t size, uint8_t mode,
+                  mmr_backend backend = mmr_backend_ept,
+                  uint32_t sample_interval = 0,
+                  uint32_t max_events_per_sec = 0,
+                  uint64_t suspend_ticks = 0);
 
 // remove an existing MMR
 void remove_mmr(void* handle);
@@ -127,6 +259,86 @@ void remove_mmr(void* handle);
 // remove every installed MMR
 void remove_all_mmrs();
 
+// start tracking which pages in a physical memory range are written to
+bool enable_dirty_logging(uint64_t address, uint64_t size);
+
+// stop tracking dirty pages
+void disable_dirty_logging();
+
+// start a new checkpoint by marking every page in a range as clean
+void clear_dirty_pages(uint64_t address, uint64_t size);
+
+// OR the dirty page bitmap for a physical memory range into a buffer,
+// where bit i corresponds to the page at address + i * 0x1000. returns
+// the number of dirty pages that were found.
+size_t query_dirty_pages(uint64_t address, uint64_t size, void* bitmap);
+
+// deliver ept-violations for #VE MMRs on the CURRENT logical processor
+// to the guest. ve_info is a page-aligned, non-paged buffer that the CPU
+// writes the VE information to. the handler must zero the dword at offset
+// 4 before returning or no further #VEs will be delivered. the monitored
+// pages are accessible in EPTP index 2 (use VMFUNC to switch to it).
+bool enable_ve(void* ve_info);
+
+// stop delivering ept-violations to the guest as a #VE
+void disable_ve();
+
+// get the number of accesses that were logged or dropped for an MMR
+// that was installed on the CURRENT logical processor
+bool query_mmr_stats(void* handle, mmr_stats& stats);
+
+// get the kernel CR3 values of an array of processes. cr3s[i] is 0 if
+// pids[i] could not be found. returns the number of PIDs that were resolved
+size_t query_process_cr3_batch(uint64_t const* pids, uint64_t* cr3s, size_t count);
+
+// get a snapshot of every process that is currently running. at most
+// max_count entries are written, but the total number of processes is
+// returned so that the caller can retry with a larger buffer
+size_t query_process_list(process_info* processes, size_t max_count);
+
+// get a snapshot of every kernel module that is currently loaded. at most
+// max_count entries are written, but the total number of modules is
+// returned so that the caller can retry with a larger buffer
+size_t query_module_list(module_info* modules, size_t max_count);
+
+// copy size bytes (at most dump_module_max_size) at the specified offset
+// of a loaded kernel module into a buffer, and fix up the PE headers in
+// that range. returns the size of the image, or 0 if the module wasn't
+// found, the range is invalid, or the PE headers couldn't be read. a size
+// of 0 only queries the image size. pages that aren't present are zeroed.
+// session-space images (e.g. win32k.sys) are only mapped in processes of
+// that session, so a CR3 of such a process has to be provided for them.
+// otherwise, the system CR3 is used.
+size_t dump_module(void* base, void* buffer, size_t offset, size_t size, uint64_t cr3 = 0);
+
+// resize the hypervisor log (up to 4096 messages) and change what
+// happens when it overflows
+bool configure_logger(uint32_t capacity, logger_overflow_policy policy);
+
+// get the size of the hypervisor log and the number of messages that were lost
+void query_logger_stats(logger_stats& stats);
+
+// enable or disable logger channels, where bit i of mask enables channel i.
+// returns the previous mask
+uint32_t set_logger_channels(uint32_t mask);
+
+// enable or disable CR3-load exiting on the current processor. MOV to CR3
+// doesn't cause a vm-exit for the System CR3 or any of the target values
+// (up to 3, or 4 if replace_system_target is set, which drops the System
+// CR3 from the list). when disabled, process tracking falls back to
+// sampling the guest CR3
+bool configure_cr3_exiting(bool enable, uint64_t const* targets = nullptr,
+  size_t count = 0, bool replace_system_target = false);
+
+// get the number of vm-exits for every basic exit reason on the current
+// processor. returns the number of exit reasons that are counted
+size_t query_exit_counts(uint64_t* counts, size_t count, bool reset = false);
+
+// change how vm-exit overhead is hidden from RDTSC on the current processor.
+// window_ticks is the length of an RDTSC exiting window in windowed mode
+// (0 uses the default)
+bool set_timing_mode(timing_mode mode, uint64_t window_ticks = 0);
+
 // VMCALL instruction, defined in hv.asm
 uint64_t vmx_vmcall(hypercall_input& input);
 
@@ -308,13 +520,19 @@ inline void* get_hv_base() {
 
 // write to the logger whenever a certain physical memory range is accessed
 inline void* install_mmr(uint64_t const address, uint32_t const size,
-                         uint8_t const mode) {
+                         uint8_t const mode, mmr_backend const backend,
+                         uint32_t const sample_interval,
+                         uint32_t const max_events_per_sec,
+                         uint64_t const suspend_ticks) {
   hv::hypercall_input input;
   input.code    = hv::hypercall_install_mmr;
   input.key     = hv::hypercall_key;
   input.args[0] = address;
   input.args[1] = size;
   input.args[2] = mode;
+  input.args[3] = backend;
+  input.args[4] = sample_interval | (static_cast<uint64_t>(max_events_per_sec) << 32);
+  input.args[5] = suspend_ticks;
   return reinterpret_cast<void*>(hv::vmx_vmcall(input));
 }
 
@@ -335,5 +553,180 @@ inline void remove_all_mmrs() {
   hv::vmx_vmcall(input);
 }
 
+// start tracking which pages in a physical memory range are written to
+inline bool enable_dirty_logging(uint64_t const address, uint64_t const size) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_enable_dirty_logging;
+  input.key     = hv::hypercall_key;
+  input.args[0] = address;
+  input.args[1] = size;
+  return hv::vmx_vmcall(input);
+}
+
+// stop tracking dirty pages
+inline void disable_dirty_logging() {
+  hv::hypercall_input input;
+  input.code = hv::hypercall_disable_dirty_logging;
+  input.key  = hv::hypercall_key;
+  hv::vmx_vmcall(input);
+}
+
+// start a new checkpoint by marking every page in a range as clean
+inline void clear_dirty_pages(uint64_t const address, uint64_t const size) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_clear_dirty_pages;
+  input.key     = hv::hypercall_key;
+  input.args[0] = address;
+  input.args[1] = size;
+  hv::vmx_vmcall(input);
+}
+
+// OR the dirty page bitmap for a physical memory range into a buffer
+inline size_t query_dirty_pages(uint64_t const address,
+                                uint64_t const size, void* const bitmap) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_query_dirty_pages;
+  input.key     = hv::hypercall_key;
+  input.args[0] = address;
+  input.args[1] = size;
+  input.args[2] = reinterpret_cast<uint64_t>(bitmap);
+  return hv::vmx_vmcall(input);
+}
+
+// deliver ept-violations for #VE MMRs on the CURRENT logical processor
+inline bool enable_ve(void* const ve_info) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_enable_ve;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(ve_info);
+  return hv::vmx_vmcall(input);
+}
+
+// stop delivering ept-violations to the guest as a #VE
+inline void disable_ve() {
+  hv::hypercall_input input;
+  input.code = hv::hypercall_disable_ve;
+  input.key  = hv::hypercall_key;
+  hv::vmx_vmcall(input);
+}
+
+// get the number of accesses that were logged or dropped for an MMR
+inline bool query_mmr_stats(void* const handle, mmr_stats& stats) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_query_mmr_stats;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(handle);
+  input.args[1] = reinterpret_cast<uint64_t>(&stats);
+  return hv::vmx_vmcall(input);
+}
+
+// get the kernel CR3 values of an array of processes
+inline size_t query_process_cr3_batch(
+    uint64_t const* const pids, uint64_t* const cr3s, size_t const count) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_query_process_cr3_batch;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(pids);
+  input.args[1] = reinterpret_cast<uint64_t>(cr3s);
+  input.args[2] = count;
+  return hv::vmx_vmcall(input);
+}
+
+// get a snapshot of every process that is currently running
+inline size_t query_process_list(process_info* const processes, size_t const max_count) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_query_process_list;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(processes);
+  input.args[1] = max_count;
+  return hv::vmx_vmcall(input);
+}
+
+// get a snapshot of every kernel module that is currently loaded
+inline size_t query_module_list(module_info* const modules, size_t const max_count) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_query_module_list;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(modules);
+  input.args[1] = max_count;
+  return hv::vmx_vmcall(input);
+}
+
+// copy part of a loaded kernel module into a buffer and fix up its PE headers
+inline size_t dump_module(void* const base, void* const buffer,
+    size_t const offset, size_t const size, uint64_t const cr3) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_dump_module;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(base);
+  input.args[1] = reinterpret_cast<uint64_t>(buffer);
+  input.args[2] = offset;
+  input.args[3] = size;
+  input.args[4] = cr3;
+  return hv::vmx_vmcall(input);
+}
+
+// resize the hypervisor log and change what happens when it overflows
+inline bool configure_logger(uint32_t const capacity, logger_overflow_policy const policy) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_configure_logger;
+  input.key     = hv::hypercall_key;
+  input.args[0] = capacity;
+  input.args[1] = policy;
+  return hv::vmx_vmcall(input);
+}
+
+// get the size of the hypervisor log and the number of messages that were lost
+inline void query_logger_stats(logger_stats& stats) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_query_logger_stats;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(&stats);
+  hv::vmx_vmcall(input);
+}
+
+// enable or disable logger channels at runtime
+inline uint32_t set_logger_channels(uint32_t const mask) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_set_logger_channels;
+  input.key     = hv::hypercall_key;
+  input.args[0] = mask;
+  return static_cast<uint32_t>(hv::vmx_vmcall(input));
+}
+
+// enable or disable CR3-load exiting on the current processor
+inline bool configure_cr3_exiting(bool const enable, uint64_t const* const targets,
+    size_t const count, bool const replace_system_target) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_configure_cr3_exiting;
+  input.key     = hv::hypercall_key;
+  input.args[0] = enable;
+  input.args[1] = reinterpret_cast<uint64_t>(targets);
+  input.args[2] = count;
+  input.args[3] = replace_system_target;
+  return hv::vmx_vmcall(input);
+}
+
+// get the number of vm-exits for every exit reason on the current processor
+inline size_t query_exit_counts(uint64_t* const counts, size_t const count, bool const reset) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_query_exit_counts;
+  input.key     = hv::hypercall_key;
+  input.args[0] = reinterpret_cast<uint64_t>(counts);
+  input.args[1] = count;
+  input.args[2] = reset;
+  return hv::vmx_vmcall(input);
+}
+
+// change how vm-exit overhead is hidden from RDTSC on the current processor
+inline bool set_timing_mode(timing_mode const mode, uint64_t const window_ticks) {
+  hv::hypercall_input input;
+  input.code    = hv::hypercall_set_timing_mode;
+  input.key     = hv::hypercall_key;
+  input.args[0] = mode;
+  input.args[1] = window_ticks;
+  return hv::vmx_vmcall(input);
+}
+
 } // namespace hv
 
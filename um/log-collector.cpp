@@ -0,0 +1,306 @@
+#include "log-collector.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+namespace logs {
+
+// magic bytes at the start of every log file
+inline constexpr uint8_t file_magic[] = { 'H', 'V', 'L', 'O', 'G', 0x01 };
+
+// number of records that are drained at once (same as the old stack buffer)
+inline constexpr uint32_t drain_batch_size = 512;
+
+// append a varint to a buffer
+size_t encode_varint(uint8_t* const buffer, uint64_t value) {
+  size_t size = 0;
+
+  while (value >= 0x80) {
+    buffer[size++] = static_cast<uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+
+  buffer[size++] = static_cast<uint8_t>(value);
+  return size;
+}
+
+// read a varint from a buffer
+size_t decode_varint(uint8_t const* const buffer, size_t const size, uint64_t& value) {
+  value = 0;
+
+  for (size_t i = 0; i < size && i < 10; ++i) {
+    value |= uint64_t(buffer[i] & 0x7F) << (i * 7);
+
+    if (!(buffer[i] & 0x80))
+      return i + 1;
+  }
+
+  return 0;
+}
+
+// map signed deltas to small unsigned values
+static uint64_t zigzag(int64_t const value) {
+  return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t const value) {
+  return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+// decode the contents of a log file that was written by log_collector
+bool decode_log_file(uint8_t const* const buffer,
+    size_t const size, std::vector<log_record>& records) {
+  if (size < sizeof(file_magic) || memcmp(buffer, file_magic, sizeof(file_magic)))
+    return false;
+
+  // values of the previous record in the file
+  uint64_t prev_id  = 0;
+  uint64_t prev_tsc = 0;
+
+  for (size_t offset = sizeof(file_magic); offset < size;) {
+    // [id delta][tsc delta][aux][channel][length]
+    uint64_t fields[5];
+
+    for (auto& field : fields) {
+      auto const length = decode_varint(buffer + offset, size - offset, field);
+      if (!length)
+        return false;
+
+      offset += length;
+    }
+
+    auto const length = fields[4];
+    if (length > log_record::max_msg_length || length > size - offset)
+      return false;
+
+    log_record record = {};
+    record.id      = prev_id + uint64_t(unzigzag(fields[0]));
+    record.tsc     = prev_tsc + uint64_t(unzigzag(fields[1]));
+    record.aux     = static_cast<uint32_t>(fields[2]);
+    record.channel = static_cast<uint32_t>(fields[3]);
+    memcpy(record.data, buffer + offset, size_t(length));
+
+    // the writer doesn't store the null-terminator
+    if (length < log_record::max_msg_length)
+      record.data[length] = '\0';
+
+    offset  += size_t(length);
+    prev_id  = record.id;
+    prev_tsc = record.tsc;
+
+    records.push_back(record);
+  }
+
+  return true;
+}
+
+// read and decode a log file from disk
+bool read_log_file(std::string const& path, std::vector<log_record>& records) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+
+  std::vector<uint8_t> const contents(
+    (std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  return decode_log_file(contents.data(), contents.size(), records);
+}
+
+log_collector::log_collector(drain_fn drain, collector_config config)
+  : drain(std::move(drain))
+  , config(std::move(config))
+  , queue(this->config.queue_capacity) {}
+
+log_collector::~log_collector() {
+  stop();
+}
+
+void log_collector::start() {
+  stop_draining = false;
+  draining_done = false;
+
+  files.clear();
+
+  start_time = std::chrono::duration_cast<std::chrono::seconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+
+  drainer = std::thread(&log_collector::run_drainer, this);
+  writer  = std::thread(&log_collector::run_writer, this);
+}
+
+// drain any remaining records and wait for them to be written
+void log_collector::stop() {
+  stop_draining = true;
+
+  if (drainer.joinable())
+    drainer.join();
+
+  if (writer.joinable())
+    writer.join();
+}
+
+void log_collector::run_drainer() {
+  std::vector<log_record> records(drain_batch_size);
+
+  auto interval = config.min_poll_interval;
+
+  // id of the last record that was drained, for detecting gaps
+  bool     has_last_id = false;
+  uint64_t last_id     = 0;
+
+  while (true) {
+    // keep polling after stop() is requested until every straggler is drained
+    auto const stopping = stop_draining.load();
+
+    auto const count = drain(records.data(), drain_batch_size);
+    stats.drained += count;
+
+    for (uint32_t i = 0; i < count; ++i) {
+      auto const& record = records[i];
+
+      // messages that were overwritten in the hypervisor's ring buffer
+      if (has_last_id && record.id > last_id + 1)
+        stats.dropped_by_hv += record.id - last_id - 1;
+
+      has_last_id = true;
+      last_id     = record.id;
+
+      if (!queue.push(record))
+        ++stats.dropped_by_queue;
+    }
+
+    // keep draining as fast as possible while the logs are busy
+    if (count >= drain_batch_size || (stopping && count > 0))
+      continue;
+
+    if (stopping)
+      break;
+
+    if (count > 0)
+      interval = config.min_poll_interval;
+    else
+      interval = std::min(interval * 2, config.max_poll_interval);
+
+    std::this_thread::sleep_for(interval);
+  }
+
+  draining_done = true;
+}
+
+void log_collector::run_writer() {
+  std::ofstream file;
+  uint64_t file_index = 0;
+  uint64_t file_size  = 0;
+
+  // values of the previous record in the current file
+  uint64_t prev_id  = 0;
+  uint64_t prev_tsc = 0;
+
+  // the largest possible encoded record
+  uint8_t buffer[10 * 5 + log_record::max_msg_length];
+
+  auto const open_next_file = [&] {
+    if (file.is_open())
+      file.close();
+
+    std::string path;
+
+    // skip over existing files (if two runs start in the same second) so
+    // that old logs are never overwritten
+    do {
+      path = config.path_prefix + "." + std::to_string(start_time) +
+        "." + std::to_string(file_index++) + ".hvlog";
+    } while (std::ifstream(path).is_open());
+
+    file.open(path, std::ios::binary);
+    if (!file.is_open()) {
+      ++stats.open_failures;
+      --file_index;
+      return;
+    }
+
+    file.write(reinterpret_cast<char const*>(file_magic), sizeof(file_magic));
+
+    file_size = sizeof(file_magic);
+    prev_id   = 0;
+    prev_tsc  = 0;
+
+    ++stats.files_written;
+    stats.bytes_written += sizeof(file_magic);
+
+    files.push_back(path);
+
+    // remove the oldest file once there are too many
+    if (config.max_file_count != 0 && files.size() > config.max_file_count) {
+      if (std::remove(files.front().c_str()) == 0)
+        ++stats.files_removed;
+
+      files.pop_front();
+    }
+  };
+
+  open_next_file();
+
+  auto idle_interval = config.min_poll_interval;
+
+  while (true) {
+    log_record record;
+
+    if (!queue.pop(record)) {
+      if (!draining_done) {
+        file.flush();
+        std::this_thread::sleep_for(idle_interval);
+        idle_interval = std::min(idle_interval * 2, config.max_poll_interval);
+        continue;
+      }
+
+      // the drainer has stopped, so this is the last chance to see any
+      // records that were pushed right before it finished
+      if (!queue.pop(record))
+        break;
+    }
+
+    idle_interval = config.min_poll_interval;
+
+    // rotate before encoding, since deltas restart at the beginning of a file.
+    // this also retries opening a file if the previous attempt failed.
+    if (!file.is_open() || file_size + sizeof(buffer) > config.max_file_size)
+      open_next_file();
+
+    if (!file.is_open()) {
+      ++stats.dropped_by_writer;
+      continue;
+    }
+
+    auto const length = strnlen(record.data, log_record::max_msg_length);
+
+    size_t size = 0;
+    size += encode_varint(buffer + size, zigzag(int64_t(record.id - prev_id)));
+    size += encode_varint(buffer + size, zigzag(int64_t(record.tsc - prev_tsc)));
+    size += encode_varint(buffer + size, record.aux);
+    size += encode_varint(buffer + size, record.channel);
+    size += encode_varint(buffer + size, length);
+    memcpy(buffer + size, record.data, length);
+    size += length;
+
+    file.write(reinterpret_cast<char const*>(buffer), size);
+
+    file_size += size;
+    prev_id    = record.id;
+    prev_tsc   = record.tsc;
+
+    ++stats.written;
+    stats.bytes_written += size;
+
+    if (config.on_record)
+      config.on_record(record);
+  }
+
+  file.flush();
+}
+
+} // namespace logs
+
@@ -0,0 +1,175 @@
+#pragma once
+
+// this file (and log-collector.cpp) only depends on the standard library
+// so that the collector can be run against a simulated log source.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace logs {
+
+// same layout as hv::logger_msg
+struct log_record {
+  static constexpr uint32_t max_msg_length = 128;
+
+  uint64_t id;
+  uint64_t tsc;
+  uint32_t aux;
+  uint32_t channel;
+  char     data[max_msg_length];
+};
+
+// drain up to max_count records from the hypervisor. returns the
+// number of records that were written to the buffer.
+using drain_fn = std::function<uint32_t(log_record* records, uint32_t max_count)>;
+
+// bounded single-producer single-consumer queue
+template <typename T>
+struct spsc_queue {
+  // capacity must be a power of 2
+  explicit spsc_queue(size_t const capacity)
+    : buffer(std::make_unique<T[]>(capacity)), mask(capacity - 1) {}
+
+  // returns false if the queue is full
+  bool push(T const& value) {
+    auto const curr_tail = tail.load(std::memory_order_relaxed);
+    if (curr_tail - head.load(std::memory_order_acquire) > mask)
+      return false;
+
+    buffer[curr_tail & mask] = value;
+    tail.store(curr_tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // returns false if the queue is empty
+  bool pop(T& value) {
+    auto const curr_head = head.load(std::memory_order_relaxed);
+    if (curr_head == tail.load(std::memory_order_acquire))
+      return false;
+
+    value = buffer[curr_head & mask];
+    head.store(curr_head + 1, std::memory_order_release);
+    return true;
+  }
+
+  std::unique_ptr<T[]> buffer;
+  size_t mask;
+
+  // keep the producer and consumer indices on separate cache lines
+  alignas(64) std::atomic<size_t> head = 0;
+  alignas(64) std::atomic<size_t> tail = 0;
+};
+
+struct collector_config {
+  // rotated files are named <path_prefix>.<start time>.<index>.hvlog, where
+  // the start time is in seconds since the epoch. existing files are never
+  // overwritten
+  std::string path_prefix = "hvlog";
+
+  // start a new file once the current one reaches this size
+  uint64_t max_file_size = 64ull * 1024 * 1024;
+
+  // delete the oldest file from this run once there are more than this
+  // many files (0 for no limit)
+  uint32_t max_file_count = 16;
+
+  // the polling interval doubles (up to the max) every time that a
+  // poll comes back empty, and is reset once messages show up again
+  std::chrono::microseconds min_poll_interval = std::chrono::microseconds(100);
+  std::chrono::microseconds max_poll_interval = std::chrono::milliseconds(20);
+
+  // number of records that can be queued between draining and writing
+  size_t queue_capacity = 0x4000;
+
+  // optional callback that is called (on the writer thread) for every record
+  std::function<void(log_record const&)> on_record;
+};
+
+struct collector_stats {
+  // records that were drained from the hypervisor
+  std::atomic<uint64_t> drained = 0;
+
+  // records that were written to disk
+  std::atomic<uint64_t> written = 0;
+
+  // records that the hypervisor dropped (gaps in logger_msg::id)
+  std::atomic<uint64_t> dropped_by_hv = 0;
+
+  // records that were dropped because the writer couldn't keep up
+  std::atomic<uint64_t> dropped_by_queue = 0;
+
+  // records that were dropped because no file could be opened
+  std::atomic<uint64_t> dropped_by_writer = 0;
+
+  std::atomic<uint64_t> bytes_written = 0;
+  std::atomic<uint64_t> files_written = 0;
+  std::atomic<uint64_t> files_removed = 0;
+  std::atomic<uint64_t> open_failures = 0;
+};
+
+// drains the hypervisor logs on one thread and writes them to disk on
+// another, so that slow disk I/O never delays draining.
+//
+// each file starts with the "HVLOG\x01" magic, followed by records that
+// are encoded as varints relative to the previous record in the file
+// (deltas are zigzag-encoded since TSCs from different cpus can go back):
+//   [id delta][tsc delta][aux][channel][length][data]
+struct log_collector {
+  log_collector(drain_fn drain, collector_config config);
+  ~log_collector();
+
+  log_collector(log_collector const&) = delete;
+  log_collector& operator=(log_collector const&) = delete;
+
+  void start();
+
+  // drain any remaining records and wait for them to be written
+  void stop();
+
+  void run_drainer();
+  void run_writer();
+
+  drain_fn         drain;
+  collector_config config;
+  collector_stats  stats;
+
+  spsc_queue<log_record> queue;
+
+  std::atomic<bool> stop_draining = false;
+  std::atomic<bool> draining_done = false;
+
+  // seconds since the epoch when start() was called
+  uint64_t start_time = 0;
+
+  // files from this run that are still on disk, oldest first. this is
+  // owned by the writer thread, so only access it after stop()
+  std::deque<std::string> files;
+
+  std::thread drainer;
+  std::thread writer;
+};
+
+// append a varint to a buffer. returns the number of bytes written (max 10)
+size_t encode_varint(uint8_t* buffer, uint64_t value);
+
+// read a varint from a buffer. returns the number of bytes read, or 0 if
+// the varint is truncated
+size_t decode_varint(uint8_t const* buffer, size_t size, uint64_t& value);
+
+// decode the contents of a log file that was written by log_collector.
+// returns false if the magic is wrong or the last record is truncated, in
+// which case records holds every record that was decoded before the error.
+bool decode_log_file(uint8_t const* buffer, size_t size, std::vector<log_record>& records);
+
+// read and decode a log file from disk
+bool read_log_file(std::string const& path, std::vector<log_record>& records);
+
+} // namespace logs
+
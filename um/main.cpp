@@ -1,9 +1,131 @@
 #include <iostream>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <intrin.h>
 
 #include "hv.h"
+#include "cpu-pool.h"
 #include "dumper.h"
+#include "log-collector.h"
+
+static_assert(sizeof(hv::logger_msg) == sizeof(logs::log_record));
+
+// print the records in a log file that was written by the collector
+static int decode_logs(char const* const path) {
+  std::vector<logs::log_record> records;
+  auto const success = logs::read_log_file(path, records);
+
+  for (auto const& msg : records)
+    printf("[%I64u][CPU=%u] %.*s\n", msg.id, msg.aux,
+      int(logs::log_record::max_msg_length), msg.data);
+
+  if (!success) {
+    printf("Failed to decode %s (%zu records were read).\n", path, records.size());
+    return 1;
+  }
+
+  return 0;
+}
+
+// the results of timing RDTSC or RDTSCP in a loop
+struct rdtsc_timing {
+  // real time per call (in ns), which isn't affected by TSC offsetting
+  double real_ns;
+
+  // TSC ticks per call, as seen by the guest
+  double guest_ticks;
+};
+
+// call read_tsc() in batches of count until at least a second has passed.
+// GetTickCount64() doesn't use the TSC, so it can't hide the vm-exits.
+template <typename ReadTsc>
+static rdtsc_timing time_rdtsc(ReadTsc const& read_tsc, uint64_t const count) {
+  uint64_t calls = 0;
+  uint64_t guest_ticks = 0;
+
+  auto const start_ms = GetTickCount64();
+  auto end_ms = start_ms;
+
+  while (end_ms - start_ms < 1000) {
+    auto const start_tsc = read_tsc();
+
+    for (uint64_t i = 0; i < count; ++i)
+      read_tsc();
+
+    guest_ticks += read_tsc() - start_tsc;
+    calls       += count + 1;
+    end_ms       = GetTickCount64();
+  }
+
+  return { (end_ms - start_ms) * 1'000'000.0 / calls, double(guest_ticks) / calls };
+}
+
+// time RDTSC and RDTSCP in every timing mode
+static int bench_rdtsc(uint64_t const count) {
+  if (!hv::is_hv_running()) {
+    printf("HV not running.\n");
+    return 1;
+  }
+
+  // the timing mode is per-vcpu, so stay on a single processor
+  SetThreadAffinityMask(GetCurrentThread(), 1);
+
+  auto const set_timing_mode = [](hv::timing_mode const mode) {
+    std::atomic<bool> success = true;
+    hv::for_each_cpu_parallel([&](uint32_t) {
+      if (!hv::set_timing_mode(mode))
+        success = false;
+    });
+    return success.load();
+  };
+
+  struct {
+    hv::timing_mode mode;
+    char const*     name;
+  } const modes[] = {
+    { hv::timing_mode_offset,   "offset"   },
+    { hv::timing_mode_windowed, "windowed" },
+    { hv::timing_mode_exit,     "exit"     }
+  };
+
+  // RDTSC doesn't exit in the offset mode, so this is the real TSC frequency
+  set_timing_mode(hv::timing_mode_offset);
+  auto const baseline   = time_rdtsc([] { return __rdtsc(); }, count);
+  auto const tsc_per_ns = baseline.guest_ticks / baseline.real_ns;
+
+  printf("%-10s %16s %16s %16s %16s\n", "mode",
+    "RDTSC cycles", "RDTSC (guest)", "RDTSCP cycles", "RDTSCP (guest)");
+
+  for (auto const& m : modes) {
+    if (!set_timing_mode(m.mode)) {
+      printf("Failed to set the %s timing mode.\n", m.name);
+      continue;
+    }
+
+    auto const rdtsc  = time_rdtsc([] { return __rdtsc(); }, count);
+    auto const rdtscp = time_rdtsc([] { unsigned int aux; return __rdtscp(&aux); }, count);
+
+    printf("%-10s %16.1f %16.1f %16.1f %16.1f\n", m.name,
+      rdtsc.real_ns * tsc_per_ns, rdtsc.guest_ticks,
+      rdtscp.real_ns * tsc_per_ns, rdtscp.guest_ticks);
+  }
+
+  // back to the default mode
+  set_timing_mode(hv::timing_mode_offset);
+
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  // um.exe decode <file>
+  if (argc == 3 && strcmp(argv[1], "decode") == 0)
+    return decode_logs(argv[2]);
+
+  // um.exe bench-rdtsc [calls per batch]
+  if (argc >= 2 && strcmp(argv[1], "bench-rdtsc") == 0)
+    return bench_rdtsc(argc >= 3 ? strtoull(argv[2], nullptr, 10) : 100'000);
 
-int main() {
   if (!hv::is_hv_running()) {
     printf("HV not running.\n");
     return 0;
@@ -13,7 +135,7 @@ int main() {
   auto const hv_size = 0x64000;
 
   // hide the hypervisor
-  hv::for_each_cpu([&](uint32_t) {
+  hv::for_each_cpu_parallel([&](uint32_t) {
     for (size_t i = 0; i < hv_size; i += 0x1000) {
       auto const virt = hv_base + i;
       auto const phys = hv::get_physical_address(0, virt);
@@ -30,28 +152,32 @@ int main() {
 
   printf("Pinged the hypervisor! Flushing logs...\n");
 
-  FILE* file = nullptr;
-  fopen_s(&file, "hvlog.txt", "a");
+  logs::collector_config config;
+  config.on_record = [](logs::log_record const& msg) {
+    printf("[%I64u][CPU=%u] %s\n", msg.id, msg.aux, msg.data);
+  };
 
-  while (!GetAsyncKeyState(VK_RETURN)) {
-    // flush the logs
-    uint32_t count = 512;
-    hv::logger_msg msgs[512];
-    hv::flush_logs(count, msgs);
+  logs::log_collector collector([](logs::log_record* const records, uint32_t count) {
+    hv::flush_logs(count, reinterpret_cast<hv::logger_msg*>(records));
+    return count;
+  }, config);
 
-    // print the logs
-    for (uint32_t i = 0; i < count; ++i) {
-      printf("[%I64u][CPU=%u] %s\n", msgs[i].id, msgs[i].aux, msgs[i].data);
-      fprintf(file, "[%I64u][CPU=%u] %s\n", msgs[i].id, msgs[i].aux, msgs[i].data);
-    }
+  collector.start();
 
-    fflush(file);
-    Sleep(1);
-  }
+  while (!GetAsyncKeyState(VK_RETURN))
+    Sleep(50);
+
+  collector.stop();
+
+  printf("Wrote %I64u messages (%I64u dropped by the hypervisor, %I64u dropped by the collector).\n",
+    collector.stats.written.load(),
+    collector.stats.dropped_by_hv.load(),
+    collector.stats.dropped_by_queue.load() + collector.stats.dropped_by_writer.load());
 
-  fclose(file);
+  if (auto const failures = collector.stats.open_failures.load())
+    printf("Failed to open a log file %I64u times.\n", failures);
 
-  hv::for_each_cpu([](uint32_t) {
+  hv::for_each_cpu_parallel([](uint32_t) {
     hv::remove_all_mmrs();
   });
 }